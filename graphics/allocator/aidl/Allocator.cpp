@@ -120,6 +120,13 @@ ndk::ScopedAStatus Allocator::allocateOneBuffer(const BufferDescriptorInfo& desc
         ALOGE("allocateOneBuffer() failed: %d (%s)", error, strerror(-error));
         return ndk::ScopedAStatus::fromStatus(error);
     }
+
+    struct drm_metadata* meta = drm_get_metadata(handle);
+    if (meta) {
+        strlcpy(meta->name, descriptor.name.c_str(), sizeof(meta->name));
+        meta->usage = descriptor.usage;
+    }
+
     *outBufferHandle = handle;
     *outStride = stride;
     return ndk::ScopedAStatus::ok();
@@ -143,7 +150,57 @@ ndk::ScopedAStatus Allocator::allocate(const std::vector<uint8_t>& descriptor, i
         ALOGE("Failed to allocate. Failed to decode buffer descriptor: %d.\n", ret);
         return ndk::ScopedAStatus::fromStatus(ret);
     }
+    return allocateBuffers(descriptorInfo, count, outResult);
+}
+
+static BufferDescriptorInfo toHidlDescriptorInfo(
+        const AidlAllocator::BufferDescriptorInfo& descriptor) {
+    BufferDescriptorInfo info;
+    const char* name = reinterpret_cast<const char*>(descriptor.name.data());
+    info.name = std::string(name, strnlen(name, descriptor.name.size()));
+    info.width = descriptor.width;
+    info.height = descriptor.height;
+    info.layerCount = descriptor.layerCount;
+    info.format = static_cast<android::hardware::graphics::common::V1_2::PixelFormat>(
+            descriptor.format);
+    info.usage = static_cast<uint64_t>(descriptor.usage);
+    info.reservedSize = descriptor.reservedSize;
+    return info;
+}
+
+ndk::ScopedAStatus Allocator::allocate2(const AidlAllocator::BufferDescriptorInfo& descriptor,
+                                        int32_t count,
+                                        AidlAllocator::AllocationResult* outResult) {
+    ALOGV("Allocation request from process: %lu", callingPid());
+
+    bool supported = false;
+    isSupported(descriptor, &supported);
+    if (!supported) {
+        return ndk::ScopedAStatus::fromServiceSpecificError(
+                static_cast<int32_t>(AidlAllocator::AllocationError::UNSUPPORTED));
+    }
+    return allocateBuffers(toHidlDescriptorInfo(descriptor), count, outResult);
+}
+
+ndk::ScopedAStatus Allocator::isSupported(const AidlAllocator::BufferDescriptorInfo& descriptor,
+                                          bool* outResult) {
+    // single layer dumb buffers of the formats drm_gralloc lays out, no reserved region
+    *outResult = descriptor.width > 0 && descriptor.height > 0 &&
+            descriptor.layerCount == 1 && descriptor.reservedSize == 0 &&
+            descriptor.additionalOptions.empty() &&
+            drm_format_supported(static_cast<int>(descriptor.format));
+    return ndk::ScopedAStatus::ok();
+}
 
+ndk::ScopedAStatus Allocator::getIMapperLibrarySuffix(std::string* outResult) {
+    // loaded as mapper.arv.so, see graphics/mapper/stable-c
+    *outResult = "arv";
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Allocator::allocateBuffers(const BufferDescriptorInfo& descriptorInfo,
+                                              int32_t count,
+                                              AidlAllocator::AllocationResult* outResult) {
     uint32_t stride = 0;
     std::vector<const native_handle_t*> buffers;
     buffers.reserve(count);
@@ -18,10 +18,12 @@
 
 #include <aidl/android/hardware/graphics/allocator/AllocationResult.h>
 #include <aidl/android/hardware/graphics/allocator/BnAllocator.h>
+#include <aidl/android/hardware/graphics/allocator/BufferDescriptorInfo.h>
 #include <aidlcommonsupport/NativeHandle.h>
 #include <android/hardware/graphics/mapper/4.0/IMapper.h>
 
 #include <cstdint>
+#include <string>
 #include <vector>
 
 using BufferDescriptorInfo = android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo;
@@ -39,8 +41,16 @@ public:
 
     virtual ndk::ScopedAStatus allocate(const std::vector<uint8_t>& descriptor, int32_t count,
                                         AidlAllocator::AllocationResult* result) override;
+    virtual ndk::ScopedAStatus allocate2(const AidlAllocator::BufferDescriptorInfo& descriptor,
+                                         int32_t count,
+                                         AidlAllocator::AllocationResult* result) override;
+    virtual ndk::ScopedAStatus isSupported(const AidlAllocator::BufferDescriptorInfo& descriptor,
+                                           bool* outResult) override;
+    virtual ndk::ScopedAStatus getIMapperLibrarySuffix(std::string* outResult) override;
 
 private:
+    ndk::ScopedAStatus allocateBuffers(const BufferDescriptorInfo& descriptor, int32_t count,
+                                       AidlAllocator::AllocationResult* result);
     ndk::ScopedAStatus allocateOneBuffer(const BufferDescriptorInfo& descriptor,
                                             buffer_handle_t* outBufferHandle,
                                             uint32_t* outStride);
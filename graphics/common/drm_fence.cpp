@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2023 Android-RPi Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define LOG_TAG "drm_gralloc"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <utils/Timers.h>
+#include <utils/Trace.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <atomic>
+#include <string>
+
+// We would eliminate the non-conforming zero-length array, but we can't since
+// this is effectively included from the Linux kernel
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wzero-length-array"
+#include <sync/sync.h>
+#pragma clang diagnostic pop
+
+#include "drm_gralloc.h"
+
+/* waits longer than this are logged together with the producing timeline */
+static const int64_t kSlowWaitNs = 16666667;
+static const int kWarningTimeoutMs = 3000;
+/* print the histogram every time this many waits have been recorded */
+static const uint64_t kReportInterval = 512;
+
+static std::atomic<uint64_t> wait_histogram[DRM_FENCE_WAIT_BUCKETS];
+static std::atomic<uint64_t> wait_count;
+
+/* bucket i counts waits below 64us << i, the last one everything above */
+static int wait_bucket(int64_t ns)
+{
+	int64_t limit = 64000;
+	int i;
+
+	for (i = 0; i < DRM_FENCE_WAIT_BUCKETS - 1; i++, limit <<= 1) {
+		if (ns < limit)
+			break;
+	}
+	return i;
+}
+
+static void log_fence_producer(const char *logname, int fence_fd, int64_t ns)
+{
+	struct sync_file_info *finfo = sync_file_info(fence_fd);
+	if (!finfo)
+		return;
+
+	struct sync_fence_info *pinfo = sync_get_fence_info(finfo);
+	for (uint32_t i = 0; i < finfo->num_fences; i++) {
+		ALOGW("%s: waited %" PRId64 " us for fence(%s) timeline(%s) drv(%s)",
+				logname, ns / 1000, finfo->name, pinfo[i].obj_name,
+				pinfo[i].driver_name);
+	}
+	sync_file_info_free(finfo);
+}
+
+static void record_wait(int64_t ns)
+{
+	wait_histogram[wait_bucket(ns)]++;
+	ATRACE_INT64("drm_gralloc fence wait us", ns / 1000);
+
+	if (++wait_count % kReportInterval)
+		return;
+
+	std::string line;
+	int64_t limit = 64;
+	for (int i = 0; i < DRM_FENCE_WAIT_BUCKETS; i++, limit <<= 1) {
+		char bucket[48];
+		snprintf(bucket, sizeof(bucket), " %s%" PRId64 "us:%" PRIu64,
+				i < DRM_FENCE_WAIT_BUCKETS - 1 ? "<" : ">=",
+				i < DRM_FENCE_WAIT_BUCKETS - 1 ? limit : limit >> 1,
+				wait_histogram[i].load());
+		line += bucket;
+	}
+	ALOGI("fence waits (%" PRIu64 "):%s", wait_count.load(), line.c_str());
+}
+
+int drm_wait_fence(int fence_fd, const char *logname)
+{
+	if (fence_fd < 0)
+		return 0;
+
+	/* fast path, the producer is usually done by the time we lock */
+	if (sync_wait(fence_fd, 0) == 0)
+		return 0;
+	if (errno != ETIME)
+		return -errno;
+
+	ATRACE_NAME(logname);
+	nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+	int err = sync_wait(fence_fd, kWarningTimeoutMs);
+	if (err < 0 && errno == ETIME) {
+		ALOGE("%s: fence %d didn't signal in %d ms", logname, fence_fd,
+				kWarningTimeoutMs);
+		err = sync_wait(fence_fd, -1);
+	}
+	if (err < 0)
+		return -errno;
+
+	int64_t waited = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+	if (waited >= kSlowWaitNs)
+		log_fence_producer(logname, fence_fd, waited);
+	record_wait(waited);
+	return 0;
+}
+
+void drm_fence_wait_histogram(uint64_t counts[DRM_FENCE_WAIT_BUCKETS])
+{
+	for (int i = 0; i < DRM_FENCE_WAIT_BUCKETS; i++)
+		counts[i] = wait_histogram[i].load();
+}
@@ -23,19 +23,29 @@
 #define LOG_TAG "drm_gralloc"
 //#define LOG_NDEBUG 0
 #include <utils/Log.h>
+#include <cutils/ashmem.h>
 #include <cutils/properties.h>
 #include <sys/errno.h>
 #include <sys/mman.h>
+#include <inttypes.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
 #include <unordered_map>
+#include <vector>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
+#include <hardware/gralloc.h>
 #include <hardware/gralloc1.h>
 
 #include "drm_gralloc.h"
+#include "drm_metadata.h"
 
 static int get_bpp(int format)
 {
@@ -70,11 +80,277 @@ static int get_bpp(int format)
 	return bpp;
 }
 
+static int drm_metadata_create(const private_handle_t *hnd, uint64_t buffer_id,
+		int *out_fd, uint64_t *out_base)
+{
+	int fd = ashmem_create_region("drm_gralloc_metadata", DRM_METADATA_SIZE);
+	if (fd < 0) {
+		ALOGE("failed to create metadata region : %s", strerror(errno));
+		return -ENOMEM;
+	}
+
+	void *map = mmap(nullptr, DRM_METADATA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ALOGE("failed to map metadata region : %s", strerror(errno));
+		close(fd);
+		return -ENOMEM;
+	}
+
+	struct drm_metadata *meta = new (map) drm_metadata();
+	meta->magic = drm_metadata::sMagic;
+	meta->version = drm_metadata::sVersion;
+	meta->buffer_id = buffer_id;
+	meta->width = hnd->width;
+	meta->height = hnd->height;
+	meta->format = hnd->format;
+	meta->size = hnd->size;
+	meta->pitch = hnd->pitch;
+	meta->seq.store(0, std::memory_order_relaxed);
+	meta->writer.store(0, std::memory_order_relaxed);
+	meta->writer_start.store(0, std::memory_order_relaxed);
+	meta->state.dataspace = HAL_DATASPACE_UNKNOWN;
+	meta->state.blend_mode = 0;  /* BlendMode::INVALID */
+
+	*out_fd = fd;
+	*out_base = (intptr_t)map;
+	return 0;
+}
+
+/*
+ * Importers only write the seqlocked page, the header is read-only to
+ * them and has to describe the buffer of the handle it came with.
+ */
+static int drm_metadata_map(const private_handle_t *hnd, uint64_t *out_base)
+{
+	void *map = mmap(nullptr, DRM_METADATA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, hnd->meta_fd, 0);
+	if (map == MAP_FAILED) {
+		ALOGE("failed to map metadata region : %s", strerror(errno));
+		return -EINVAL;
+	}
+	if (mprotect(map, DRM_METADATA_PAGE, PROT_READ) != 0) {
+		ALOGE("failed to protect metadata header : %s", strerror(errno));
+		munmap(map, DRM_METADATA_SIZE);
+		return -EINVAL;
+	}
+
+	const struct drm_metadata *meta = (const struct drm_metadata *)map;
+	if (meta->magic != drm_metadata::sMagic ||
+			meta->version != drm_metadata::sVersion) {
+		ALOGE("invalid metadata region magic %x version %u",
+				meta->magic, meta->version);
+		munmap(map, DRM_METADATA_SIZE);
+		return -EINVAL;
+	}
+	if (meta->width != hnd->width || meta->height != hnd->height ||
+			meta->format != hnd->format || meta->size != hnd->size ||
+			meta->pitch != hnd->pitch) {
+		ALOGE("metadata of buffer %" PRIu64 " describes %dx%d format 0x%x size %d "
+				"pitch %d, the handle %dx%d format 0x%x size %d pitch %d",
+				meta->buffer_id, meta->width, meta->height, meta->format,
+				meta->size, meta->pitch, hnd->width, hnd->height, hnd->format,
+				hnd->size, hnd->pitch);
+		munmap(map, DRM_METADATA_SIZE);
+		return -EINVAL;
+	}
+
+	*out_base = (intptr_t)map;
+	return 0;
+}
+
+static void drm_metadata_unmap(uint64_t base)
+{
+	if (base)
+		munmap((void *)base, DRM_METADATA_SIZE);
+}
+
+int drm_format_bpp(int format)
+{
+	return get_bpp(format);
+}
+
+bool drm_format_supported(int format)
+{
+	struct drm_format_component components[DRM_FORMAT_COMPONENTS_MAX];
+	return drm_format_components(format, components) || format == HAL_PIXEL_FORMAT_BLOB;
+}
+
+uint32_t drm_format_fourcc(int format)
+{
+	switch (format) {
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+		return DRM_FORMAT_ABGR8888;
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+		return DRM_FORMAT_XBGR8888;
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		return DRM_FORMAT_ARGB8888;
+	case HAL_PIXEL_FORMAT_RGB_888:
+		return DRM_FORMAT_BGR888;
+	case HAL_PIXEL_FORMAT_RGB_565:
+		return DRM_FORMAT_RGB565;
+	default:
+		return 0;
+	}
+}
+
+int drm_format_components(int format,
+		struct drm_format_component components[DRM_FORMAT_COMPONENTS_MAX])
+{
+	static const struct drm_format_component rgba[] = {
+		{ DRM_COMPONENT_R, 0, 8 }, { DRM_COMPONENT_G, 8, 8 },
+		{ DRM_COMPONENT_B, 16, 8 }, { DRM_COMPONENT_A, 24, 8 },
+	};
+	static const struct drm_format_component bgra[] = {
+		{ DRM_COMPONENT_B, 0, 8 }, { DRM_COMPONENT_G, 8, 8 },
+		{ DRM_COMPONENT_R, 16, 8 }, { DRM_COMPONENT_A, 24, 8 },
+	};
+	static const struct drm_format_component rgb565[] = {
+		{ DRM_COMPONENT_R, 11, 5 }, { DRM_COMPONENT_G, 5, 6 },
+		{ DRM_COMPONENT_B, 0, 5 },
+	};
+	const struct drm_format_component *table;
+	int count;
+
+	switch (format) {
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+		table = rgba;
+		count = 4;
+		break;
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+	case HAL_PIXEL_FORMAT_RGB_888:
+		table = rgba;
+		count = 3;
+		break;
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		table = bgra;
+		count = 4;
+		break;
+	case HAL_PIXEL_FORMAT_RGB_565:
+		table = rgb565;
+		count = 3;
+		break;
+	default:
+		return 0;
+	}
+	memcpy(components, table, count * sizeof(*table));
+	return count;
+}
+
+/* unique across processes: allocating pid in the upper half */
+static uint64_t next_buffer_id()
+{
+	static std::atomic<uint32_t> counter;
+	return ((uint64_t)getpid() << 32) | ++counter;
+}
+
+/*
+ * Handles registered in this process, grouped by GEM handle. Several
+ * imports of one buffer share it, and it must only be closed when the
+ * last of them goes away. The key is what this process got back from
+ * the kernel; the buffer id in the metadata page is writable by every
+ * importer and can't be trusted for that.
+ */
+static std::mutex registry_lock;
+static std::unordered_map<uint32_t, std::vector<const private_handle_t *>> registry;
+
+/*
+ * The lock state of the handles, several threads of a process may lock
+ * the same import.
+ */
+static std::mutex lock_state_lock;
+
+static uint32_t registry_key(const private_handle_t *hnd)
+{
+	return hnd->drm_handle;
+}
+
+/*
+ * Getting a GEM handle and closing it happen under registry_lock too,
+ * so an import can't pick up a handle that is about to be closed.
+ */
+static void registry_add_locked(const private_handle_t *hnd)
+{
+	registry[registry_key(hnd)].push_back(hnd);
+}
+
+/* returns the number of imports of the buffer left in this process */
+static size_t registry_remove_locked(const private_handle_t *hnd)
+{
+	auto it = registry.find(registry_key(hnd));
+	if (it == registry.end())
+		return 0;
+
+	auto &handles = it->second;
+	handles.erase(std::remove(handles.begin(), handles.end(), hnd), handles.end());
+	size_t remaining = handles.size();
+	if (!remaining)
+		registry.erase(it);
+	return remaining;
+}
+
+static void registry_fill_info(const std::vector<const private_handle_t *> &handles,
+		struct drm_buffer_info *info)
+{
+	const private_handle_t *hnd = handles.front();
+	const struct drm_metadata *meta = (const struct drm_metadata *)hnd->meta_base;
+
+	memset(info, 0, sizeof(*info));
+	info->width = hnd->width;
+	info->height = hnd->height;
+	info->stride = hnd->stride;
+	info->format = hnd->format;
+	info->size = hnd->size;
+	if (meta) {
+		struct drm_metadata_state state;
+		info->buffer_id = meta->buffer_id;
+		info->usage = meta->usage;
+		/* the allocator terminates it, but it's shared memory */
+		memcpy(info->name, meta->name, strnlen(meta->name, sizeof(info->name) - 1));
+		if (!drm_metadata_read(meta, &state))
+			info->dataspace = state.dataspace;
+	}
+	info->import_count = handles.size();
+	std::lock_guard<std::mutex> lock(lock_state_lock);
+	for (const private_handle_t *h : handles) {
+		info->mapped |= h->base != 0;
+		info->lock_count += h->lock_count;
+	}
+}
+
+int drm_get_buffer_info(buffer_handle_t handle, struct drm_buffer_info *info)
+{
+	if (private_handle_t::validate(handle) < 0)
+		return -EINVAL;
+
+	std::lock_guard<std::mutex> lock(registry_lock);
+	const private_handle_t *hnd = (const private_handle_t *)handle;
+	auto it = registry.find(registry_key(hnd));
+	/* drm_handle of a handle that wasn't imported is the sender's */
+	if (it == registry.end() ||
+			std::find(it->second.begin(), it->second.end(), hnd) == it->second.end())
+		return -ENOENT;
+	registry_fill_info(it->second, info);
+	return 0;
+}
+
+void drm_get_buffer_infos(std::vector<struct drm_buffer_info> *infos)
+{
+	std::lock_guard<std::mutex> lock(registry_lock);
+	infos->clear();
+	infos->reserve(registry.size());
+	for (const auto &entry : registry) {
+		infos->emplace_back();
+		registry_fill_info(entry.second, &infos->back());
+	}
+}
+
 static buffer_handle_t drm_create(int kms_fd,
-		int width, int height, uint64_t usage, int *stride) {
+		int width, int height, int format, uint64_t usage, int *stride) {
+    int bpp = get_bpp(format);
     struct drm_mode_create_dumb carg;
     memset (&carg, 0, sizeof (carg));
-    carg.bpp = 32;
+    carg.bpp = bpp * 8;
     carg.width = width;
     carg.height = height;
 
@@ -85,6 +361,18 @@ static buffer_handle_t drm_create(int kms_fd,
     } 
     ALOGV("CREATE_DUMB size: %lld , handle: %x ", carg.size, carg.handle);
 
+    /* the stride is in whole pixels, the driver may pad the pitch to anything */
+    if (carg.pitch % bpp) {
+        ALOGE("pitch %u of a %dx%d buffer is no multiple of %d bytes",
+                carg.pitch, width, height, bpp);
+        struct drm_mode_destroy_dumb darg;
+        memset (&darg, 0, sizeof (darg));
+        darg.handle = carg.handle;
+        drmIoctl(kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &darg);
+        errno = EINVAL;
+        return NULL;
+    }
+
     struct drm_mode_map_dumb marg;
     memset (&marg, 0, sizeof (marg));
     marg.handle = carg.handle;
@@ -107,27 +395,41 @@ static buffer_handle_t drm_create(int kms_fd,
     }
 
 
-	private_handle_t *handle = new private_handle_t(prime_fd, carg.size,
+	private_handle_t *handle = new private_handle_t(prime_fd, -1, carg.size,
 	    (usage & GRALLOC1_CONSUMER_USAGE_CLIENT_TARGET)?private_handle_t::PRIV_FLAGS_FRAMEBUFFER:0);
 	handle->base = (intptr_t)map;
 	handle->drm_handle = carg.handle;
+	handle->width = width;
+	handle->height = height;
+	handle->format = format;
 
+	handle->pitch = carg.pitch;
 	/* in pixels */
-	*stride = width;
+	*stride = carg.pitch / bpp;
+	handle->stride = *stride;
 
+	ret = drm_metadata_create(handle, next_buffer_id(), &handle->meta_fd,
+			&handle->meta_base);
+	if (ret != 0) {
+		close(prime_fd);
+		delete handle;
+		return NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(registry_lock);
+	registry_add_locked(handle);
 	return handle;
 }
 
 int drm_alloc(int kms_fd, int w, int h, int format, uint64_t usage,
 		buffer_handle_t *handle, int *stride) {
 	int err = 0;
-	int bpp = get_bpp(format);
-	if (bpp != 4) {
-	    ALOGE("drm_alloc() get_bpp() %d, format 0x%x", bpp, format);
-	    if (!bpp) return -EINVAL;
+	if (!drm_format_supported(format)) {
+	    ALOGE("drm_alloc() unsupported format 0x%x", format);
+	    return -EINVAL;
 	}
 
-	*handle = drm_create(kms_fd, w, h, usage, stride);
+	*handle = drm_create(kms_fd, w, h, format, usage, stride);
 	if (!*handle)
 		err = -errno;
 
@@ -135,12 +437,21 @@ int drm_alloc(int kms_fd, int w, int h, int format, uint64_t usage,
 	return err;
 }
 
+/* an import that failed gives its GEM handle back, unless others share it */
+static void drm_unregister_failed_locked(int kms_fd, private_handle_t *hnd)
+{
+	if (registry.find(registry_key(hnd)) == registry.end())
+		drmCloseBufferHandle(kms_fd, hnd->drm_handle);
+	hnd->drm_handle = 0;
+}
+
 int drm_register(int kms_fd, buffer_handle_t _handle)
 {
 	private_handle_t* hnd = (private_handle_t *)_handle;
     if (private_handle_t::validate(_handle) < 0)
         return -EINVAL;
 
+    std::lock_guard<std::mutex> lock(registry_lock);
     int ret = drmPrimeFDToHandle(kms_fd, hnd->fd, &hnd->drm_handle);
     if (ret != 0) {
         ALOGE("failed drmPrimeFdToHandle() : %s", strerror(errno));
@@ -153,32 +464,121 @@ int drm_register(int kms_fd, buffer_handle_t _handle)
     ret = drmIoctl(kms_fd, DRM_IOCTL_MODE_MAP_DUMB, &marg);
     if (ret != 0) {
         ALOGE("failed MAP_DUMB : %s", strerror(errno));
+        drm_unregister_failed_locked(kms_fd, hnd);
         return -EINVAL;
     }
     void *map = mmap(nullptr, hnd->size, PROT_READ | PROT_WRITE, MAP_SHARED, kms_fd, marg.offset);
     if (map == MAP_FAILED) {
         ALOGE("mmap() failed");
+        drm_unregister_failed_locked(kms_fd, hnd);
         return -EINVAL;
     }
 	hnd->base=(intptr_t)map;
+
+	/* the ints came from the sender, locks are local to this import */
+	hnd->lock_count = 0;
+	hnd->lock_usage = 0;
+	hnd->lock_offset = 0;
+	hnd->lock_length = 0;
+
+	ret = drm_metadata_map(hnd, &hnd->meta_base);
+	if (ret != 0) {
+		munmap(map, hnd->size);
+		hnd->base = 0;
+		drm_unregister_failed_locked(kms_fd, hnd);
+		return ret;
+	}
+
+	registry_add_locked(hnd);
 	return 0;
 }
 
 
-int drm_lock(buffer_handle_t handle, void **addr)
+int drm_lock(buffer_handle_t handle, uint64_t usage,
+		const struct drm_lock_rect *region, void **addr)
 {
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
 
     private_handle_t* hnd = (private_handle_t*)handle;
+    uint32_t sw_usage = usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK);
+    if (!sw_usage || !hnd->base) {
+        ALOGE("drm_lock() no CPU access usage 0x%" PRIx64 " or unmapped buffer", usage);
+        return -EINVAL;
+    }
+
+    struct drm_lock_rect r = { 0, 0, hnd->width, hnd->height };
+    if (region && region->width > 0 && region->height > 0)
+        r = *region;
+    if (r.left < 0 || r.top < 0 || r.width <= 0 || r.height <= 0 ||
+            r.left + r.width > hnd->width || r.top + r.height > hnd->height) {
+        ALOGE("drm_lock() region %d,%d %dx%d outside of %dx%d buffer",
+                r.left, r.top, r.width, r.height, hnd->width, hnd->height);
+        return -EINVAL;
+    }
+
+    /* byte span of the rows touched by the region, as the driver laid them out */
+    uint64_t bpp = hnd->stride > 0 ? hnd->pitch / hnd->stride : 0;
+    uint64_t pitch = hnd->pitch;
+    uint64_t start = r.top * pitch + r.left * bpp;
+    uint64_t span = (r.height - 1) * pitch + r.width * bpp;
+    if (!bpp || hnd->size < 0 || start + span > (uint64_t)hnd->size) {
+        ALOGE("drm_lock() pitch %d of %p does not fit its %d bytes",
+                hnd->pitch, hnd, hnd->size);
+        return -EINVAL;
+    }
+    uint32_t offset = start;
+    uint32_t length = span;
+
+    std::lock_guard<std::mutex> lock(lock_state_lock);
+    if (hnd->lock_count++) {
+        uint32_t end = std::max(hnd->lock_offset + hnd->lock_length, offset + length);
+        hnd->lock_offset = std::min(hnd->lock_offset, offset);
+        hnd->lock_length = end - hnd->lock_offset;
+        hnd->lock_usage |= sw_usage;
+    } else {
+        hnd->lock_offset = offset;
+        hnd->lock_length = length;
+        hnd->lock_usage = sw_usage;
+    }
+    ALOGV("drm_lock() %p usage 0x%x span %u+%u", hnd, hnd->lock_usage,
+            hnd->lock_offset, hnd->lock_length);
+
     *addr = (void*)hnd->base;
 	return 0;
 }
 
+int drm_flush(buffer_handle_t handle)
+{
+    if (private_handle_t::validate(handle) < 0)
+        return -EINVAL;
+
+    private_handle_t* hnd = (private_handle_t*)handle;
+    std::lock_guard<std::mutex> lock(lock_state_lock);
+    if (!hnd->lock_count)
+        return -EINVAL;
+
+    /* dumb buffers are mapped coherent; nothing to write back yet */
+	return 0;
+}
+
 int drm_unlock(buffer_handle_t handle)
 {
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
+
+    private_handle_t* hnd = (private_handle_t*)handle;
+    std::lock_guard<std::mutex> lock(lock_state_lock);
+    if (!hnd->lock_count) {
+        ALOGE("drm_unlock() %p is not locked", hnd);
+        return -EINVAL;
+    }
+
+    if (!--hnd->lock_count) {
+        hnd->lock_usage = 0;
+        hnd->lock_offset = 0;
+        hnd->lock_length = 0;
+    }
 	return 0;
 }
 
@@ -190,6 +590,12 @@ void drm_free(int kms_fd, buffer_handle_t handle) {
     if (ret != 0) {
         ALOGE("failed unmap() : %s", strerror(errno));
     }
+	drm_metadata_unmap(hnd->meta_base);
+	std::lock_guard<std::mutex> lock(registry_lock);
+	if (registry_remove_locked(hnd)) {
+		/* another import still uses the GEM handle */
+		return;
+	}
 
 	struct drm_mode_destroy_dumb darg;
     memset (&darg, 0, sizeof (darg));
@@ -23,12 +23,109 @@
 #pragma once
 
 #include <drm_handle.h>
+#include <drm_metadata.h>
+
+#include <vector>
 
 int drm_alloc(int kms_fd, int w, int h, int format, uint64_t usage,
         buffer_handle_t *handle, int *stride);
 int drm_register(int kms_fd, buffer_handle_t handle);
 
-int drm_lock(buffer_handle_t handle, void **addr);
+/*
+ * Rectangle of the buffer a CPU client intends to access, in pixels.
+ * An empty rectangle stands for the whole buffer.
+ */
+struct drm_lock_rect {
+    int left;
+    int top;
+    int width;
+    int height;
+};
+
+/*
+ * Map the buffer for CPU access. usage carries the SW read/write usage
+ * bits of the access, region the part of the buffer that will be
+ * touched; both are kept until the matching drm_unlock() so that any
+ * per-lock work only covers what the client asked for.
+ */
+int drm_lock(buffer_handle_t handle, uint64_t usage,
+        const struct drm_lock_rect *region, void **addr);
+int drm_flush(buffer_handle_t handle);
 int drm_unlock(buffer_handle_t handle);
 
 void drm_free(int kms_fd, buffer_handle_t handle);
+
+/* bytes per pixel of a HAL format as laid out in the buffer, 0 if unknown */
+int drm_format_bpp(int format);
+/*
+ * The allocator lays the format out as clients expect: one plane with
+ * known components, or BLOB bytes.
+ */
+bool drm_format_supported(int format);
+/* DRM fourcc matching a HAL format, 0 if there is none */
+uint32_t drm_format_fourcc(int format);
+
+/* same values as aidl PlaneLayoutComponentType */
+enum {
+    DRM_COMPONENT_R = 1 << 10,
+    DRM_COMPONENT_G = 1 << 11,
+    DRM_COMPONENT_B = 1 << 12,
+    DRM_COMPONENT_A = 1 << 30,
+};
+
+struct drm_format_component {
+    int64_t type;
+    int offset_bits;
+    int size_bits;
+};
+
+/*
+ * Fill in the components of a single plane format, in the order they
+ * appear in memory. Returns their number, 0 for unknown formats.
+ */
+#define DRM_FORMAT_COMPONENTS_MAX 4
+int drm_format_components(int format,
+        struct drm_format_component components[DRM_FORMAT_COMPONENTS_MAX]);
+
+/*
+ * Wait for an acquire fence without taking ownership of fence_fd.
+ * Already signaled fences return without blocking; real waits are
+ * timed and accounted in a log2 histogram of 64us << i buckets, which
+ * the composer prints in its dump.
+ */
+#define DRM_FENCE_WAIT_BUCKETS 16
+int drm_wait_fence(int fence_fd, const char *logname);
+void drm_fence_wait_histogram(uint64_t counts[DRM_FENCE_WAIT_BUCKETS]);
+
+/*
+ * Vendor metadata type under which mappers dump the fields of
+ * drm_buffer_info that have no standard metadata type, as int64.
+ */
+#define DRM_REGISTRY_METADATA_TYPE "vendor.arv.graphics.gralloc.RegistryMetadataType"
+enum {
+    DRM_REGISTRY_IMPORT_COUNT = 1,
+    DRM_REGISTRY_MAPPED = 2,
+    DRM_REGISTRY_LOCK_COUNT = 3,
+};
+
+/*
+ * Snapshot of a buffer known to this process, for dumps. Imports of the
+ * same buffer are folded into one entry.
+ */
+struct drm_buffer_info {
+    uint64_t buffer_id;
+    char name[DRM_METADATA_NAME_MAX];
+    int width;
+    int height;
+    int stride;
+    int format;
+    int size;
+    uint64_t usage;
+    int32_t dataspace;
+    uint32_t import_count;
+    uint32_t lock_count;
+    bool mapped;
+};
+
+int drm_get_buffer_info(buffer_handle_t handle, struct drm_buffer_info *info);
+void drm_get_buffer_infos(std::vector<struct drm_buffer_info> *infos);
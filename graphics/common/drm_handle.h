@@ -32,25 +32,40 @@ struct private_handle_t : public native_handle {
 
     // file-descriptors
     int     fd;
+    int     meta_fd;    /* struct drm_metadata, see drm_metadata.h */
     // ints
     int     magic;
     int     flags;
     int     size;
+    int     width;
+    int     height;
+    int     stride;     /* in pixels */
+    int     pitch;      /* in bytes, as the driver laid the buffer out */
+    int     format;
 
     uint64_t base __attribute__((aligned(8)));
+    uint64_t meta_base;
 
     uint32_t drm_handle;
-    uint32_t fb_id;
+
+    /* process-local CPU access state, maintained by drm_lock()/drm_unlock(),
+       reset by drm_register() */
+    uint32_t lock_count;
+    uint32_t lock_usage;
+    uint32_t lock_offset;
+    uint32_t lock_length;
 
     static inline int sNumInts() {
         return (((sizeof(private_handle_t) - sizeof(native_handle_t))/sizeof(int)) - sNumFds);
     }
-    static const int sNumFds = 1;
+    static const int sNumFds = 2;
     static const int sMagic = 0x3141592;
 
-    private_handle_t(int fd, int size, int flags) :
-        fd(fd), magic(sMagic), flags(flags), size(size),
-        base(0), fb_id(0)
+    private_handle_t(int fd, int meta_fd, int size, int flags) :
+        fd(fd), meta_fd(meta_fd), magic(sMagic), flags(flags), size(size),
+        width(0), height(0), stride(0), pitch(0), format(0),
+        base(0), meta_base(0),
+        lock_count(0), lock_usage(0), lock_offset(0), lock_length(0)
     {
         version = sizeof(native_handle);
         numInts = sNumInts();
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2023 Android-RPi Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Standard metadata of both mappers. Header only: the aidl types come
+ * with libgralloctypes, which the rest of libdrm_gralloc's users don't
+ * link.
+ */
+
+#include <string.h>
+#include <utils/Log.h>
+
+#include <optional>
+#include <vector>
+
+#include <gralloctypes/Gralloc4.h>
+
+#include <drm_gralloc.h>
+
+/* the single plane of hnd, nullopt for formats without a known layout */
+static inline std::optional<aidl::android::hardware::graphics::common::PlaneLayout>
+drm_plane_layout(const private_handle_t *hnd)
+{
+    using aidl::android::hardware::graphics::common::PlaneLayout;
+    using aidl::android::hardware::graphics::common::PlaneLayoutComponent;
+
+    struct drm_format_component components[DRM_FORMAT_COMPONENTS_MAX];
+    int count = drm_format_components(hnd->format, components);
+    if (!count)
+        return std::nullopt;
+
+    int bpp = drm_format_bpp(hnd->format);
+    PlaneLayout layout;
+    for (int i = 0; i < count; i++) {
+        PlaneLayoutComponent component;
+        component.type = android::gralloc4::PlaneLayoutComponentType_R;
+        component.type.value = components[i].type;
+        component.offsetInBits = components[i].offset_bits;
+        component.sizeInBits = components[i].size_bits;
+        layout.components.push_back(component);
+    }
+    layout.offsetInBytes = 0;
+    layout.sampleIncrementInBits = bpp * 8;
+    layout.strideInBytes = hnd->pitch;
+    layout.widthInSamples = hnd->width;
+    layout.heightInSamples = hnd->height;
+    layout.totalSizeInBytes = hnd->size;
+    layout.horizontalSubsampling = 1;
+    layout.verticalSubsampling = 1;
+    return layout;
+}
+
+/*
+ * Settable metadata into the shared region. -EINVAL for a value that
+ * doesn't fit, -EBUSY from drm_metadata_write(). An empty optional
+ * clears the value.
+ */
+static inline int drm_metadata_set(struct drm_metadata *meta,
+        aidl::android::hardware::graphics::common::Dataspace dataspace)
+{
+    return drm_metadata_write(meta, [&](struct drm_metadata_state *state) {
+        state->dataspace = static_cast<int32_t>(dataspace);
+    });
+}
+
+static inline int drm_metadata_set(struct drm_metadata *meta,
+        aidl::android::hardware::graphics::common::BlendMode blend_mode)
+{
+    return drm_metadata_write(meta, [&](struct drm_metadata_state *state) {
+        state->blend_mode = static_cast<int32_t>(blend_mode);
+    });
+}
+
+static inline int drm_metadata_set(struct drm_metadata *meta,
+        const std::optional<aidl::android::hardware::graphics::common::Smpte2086> &value)
+{
+    return drm_metadata_write(meta, [&](struct drm_metadata_state *state) {
+        if (!value) {
+            state->flags &= ~DRM_METADATA_HAS_SMPTE2086;
+            return;
+        }
+        struct drm_smpte2086 &s = state->smpte2086;
+        s.primary_red = { value->primaryRed.x, value->primaryRed.y };
+        s.primary_green = { value->primaryGreen.x, value->primaryGreen.y };
+        s.primary_blue = { value->primaryBlue.x, value->primaryBlue.y };
+        s.white_point = { value->whitePoint.x, value->whitePoint.y };
+        s.max_luminance = value->maxLuminance;
+        s.min_luminance = value->minLuminance;
+        state->flags |= DRM_METADATA_HAS_SMPTE2086;
+    });
+}
+
+static inline int drm_metadata_set(struct drm_metadata *meta,
+        const std::optional<aidl::android::hardware::graphics::common::Cta861_3> &value)
+{
+    return drm_metadata_write(meta, [&](struct drm_metadata_state *state) {
+        if (!value) {
+            state->flags &= ~DRM_METADATA_HAS_CTA861_3;
+            return;
+        }
+        state->cta861_3.max_content_light_level = value->maxContentLightLevel;
+        state->cta861_3.max_frame_average_light_level = value->maxFrameAverageLightLevel;
+        state->flags |= DRM_METADATA_HAS_CTA861_3;
+    });
+}
+
+/* SMPTE 2094-40 */
+static inline int drm_metadata_set(struct drm_metadata *meta,
+        const std::optional<std::vector<uint8_t>> &value)
+{
+    if (value && value->size() > DRM_METADATA_SMPTE2094_40_MAX) {
+        ALOGE("SMPTE 2094-40 metadata of %zu bytes does not fit", value->size());
+        return -EINVAL;
+    }
+    return drm_metadata_write(meta, [&](struct drm_metadata_state *state) {
+        if (!value) {
+            state->flags &= ~DRM_METADATA_HAS_SMPTE2094_40;
+            state->smpte2094_40_size = 0;
+            return;
+        }
+        memcpy(state->smpte2094_40, value->data(), value->size());
+        state->smpte2094_40_size = value->size();
+        state->flags |= DRM_METADATA_HAS_SMPTE2094_40;
+    });
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2023 Android-RPi Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define LOG_TAG "drm_gralloc"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "drm_metadata.h"
+
+/* a writer that died halfway leaves seq odd; don't wait on it forever */
+static const int kMaxReadRetries = 1000;
+
+struct drm_metadata *drm_get_metadata(buffer_handle_t handle)
+{
+    if (private_handle_t::validate(handle) < 0)
+        return NULL;
+
+    const private_handle_t *hnd = (const private_handle_t *)handle;
+    return (struct drm_metadata *)hnd->meta_base;
+}
+
+int drm_metadata_read(const struct drm_metadata *meta,
+		struct drm_metadata_state *out)
+{
+	for (int retries = 0; retries < kMaxReadRetries; retries++) {
+		if (retries)
+			sched_yield();
+		uint32_t seq = meta->seq.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		memcpy(out, &meta->state, sizeof(*out));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (meta->seq.load(std::memory_order_relaxed) == seq)
+			return 0;
+	}
+	ALOGW("metadata of buffer %" PRIu64 " is stuck in an update", meta->buffer_id);
+	return -EBUSY;
+}
+
+/*
+ * Start time of a process in clock ticks since boot, field 22 of its
+ * stat. 0 if it can't be read, e.g. hidden by hidepid.
+ */
+static uint64_t process_start_time(pid_t pid)
+{
+	char path[32], buf[512];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	/* the command name may hold spaces and parentheses, skip past it */
+	char *p = strrchr(buf, ')');
+	for (int field = 2; p && field < 22; field++)
+		p = strchr(p + 1, ' ');
+	return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+void drm_metadata_claim(struct drm_metadata *meta)
+{
+	static const uint64_t start = process_start_time(getpid());
+	meta->writer_start.store(start, std::memory_order_relaxed);
+	meta->writer.store(getpid(), std::memory_order_release);
+}
+
+void drm_metadata_unclaim(struct drm_metadata *meta)
+{
+	meta->writer.store(0, std::memory_order_relaxed);
+}
+
+/*
+ * Only a writer known to be gone is taken over: no such pid, or a pid
+ * that started at another time. A live one, or one that can't be told
+ * apart from a live one, keeps seq.
+ */
+static bool writer_dead(int32_t pid, uint64_t start)
+{
+	if (kill(pid, 0) != 0 && errno == ESRCH)
+		return true;
+	uint64_t now = process_start_time(pid);
+	return start && now && now != start;
+}
+
+bool drm_metadata_recover(struct drm_metadata *meta, uint32_t *seq)
+{
+	/* 0 is a writer between taking seq and saying who it is */
+	int32_t pid = meta->writer.load(std::memory_order_acquire);
+	uint64_t start = meta->writer_start.load(std::memory_order_relaxed);
+	if (!pid || !writer_dead(pid, start))
+		return false;
+
+	/* recovering writers race too: whoever moves seq on owns it */
+	uint32_t stuck = *seq;
+	if (!meta->seq.compare_exchange_strong(stuck, stuck + 2,
+			std::memory_order_acquire, std::memory_order_relaxed))
+		return false;
+	ALOGW("metadata of buffer %" PRIu64 " was left mid-update by pid %d, taking over",
+			meta->buffer_id, pid);
+	*seq = stuck + 2;
+	return true;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2023 Android-RPi Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include <drm_handle.h>
+
+/*
+ * Per-buffer metadata block, allocated as a small shared memory region
+ * next to each buffer and passed along as the second fd of the handle.
+ * Every process that imports the buffer maps the same region, so producer
+ * and consumer see each other's metadata updates without any IPC.
+ */
+
+#define DRM_METADATA_NAME_MAX           128
+#define DRM_METADATA_SMPTE2094_40_MAX   1024
+
+enum {
+    DRM_METADATA_HAS_SMPTE2086      = 1 << 0,
+    DRM_METADATA_HAS_CTA861_3       = 1 << 1,
+    DRM_METADATA_HAS_SMPTE2094_40   = 1 << 2,
+};
+
+struct drm_xy_color {
+    float x;
+    float y;
+};
+
+struct drm_smpte2086 {
+    struct drm_xy_color primary_red;
+    struct drm_xy_color primary_green;
+    struct drm_xy_color primary_blue;
+    struct drm_xy_color white_point;
+    float max_luminance;
+    float min_luminance;
+};
+
+struct drm_cta861_3 {
+    float max_content_light_level;
+    float max_frame_average_light_level;
+};
+
+/* the part of the metadata that may change after allocation */
+struct drm_metadata_state {
+    int32_t dataspace;
+    int32_t blend_mode;
+    uint32_t flags;
+    struct drm_smpte2086 smpte2086;
+    struct drm_cta861_3 cta861_3;
+    uint32_t smpte2094_40_size;
+    uint8_t smpte2094_40[DRM_METADATA_SMPTE2094_40_MAX];
+};
+
+/* the region is two pages, the header one is mapped read-only by importers */
+#define DRM_METADATA_PAGE 4096
+
+struct drm_metadata {
+    uint32_t magic;
+    uint32_t version;
+
+    /*
+     * Immutable once the allocator returned the buffer. Importers check
+     * the buffer fields against the handle before trusting either.
+     */
+    uint64_t buffer_id;
+    uint64_t usage;
+    char name[DRM_METADATA_NAME_MAX];
+    int32_t width;
+    int32_t height;
+    int32_t format;
+    int32_t size;
+    int32_t pitch;
+
+    /*
+     * Sequence lock around state: odd while a writer is updating it.
+     * std::atomic<uint32_t> is lock-free and address-free, so it works
+     * across processes sharing the mapping.
+     */
+    alignas(DRM_METADATA_PAGE) std::atomic<uint32_t> seq;
+    /*
+     * The process holding seq odd, so a dead one can be told: its pid
+     * and start time, which a recycled pid doesn't share.
+     */
+    std::atomic<int32_t> writer;
+    std::atomic<uint64_t> writer_start;
+    struct drm_metadata_state state;
+
+    static const uint32_t sMagic = 0x6d657461;
+    static const uint32_t sVersion = 3;
+};
+
+/* size of the shared region */
+#define DRM_METADATA_SIZE (2 * DRM_METADATA_PAGE)
+static_assert(sizeof(struct drm_metadata) <= DRM_METADATA_SIZE,
+        "drm_metadata does not fit its region");
+static_assert(offsetof(struct drm_metadata, seq) == DRM_METADATA_PAGE,
+        "drm_metadata header does not fit its page");
+
+/* returns NULL if the handle has no valid metadata mapped */
+struct drm_metadata *drm_get_metadata(buffer_handle_t handle);
+
+/*
+ * Consistent snapshot of the mutable state. Yields while a writer is
+ * in the middle of an update, -EBUSY if it doesn't finish.
+ */
+int drm_metadata_read(const struct drm_metadata *meta,
+        struct drm_metadata_state *out);
+
+/* say this process holds seq odd, and take it back before releasing seq */
+void drm_metadata_claim(struct drm_metadata *meta);
+void drm_metadata_unclaim(struct drm_metadata *meta);
+
+/*
+ * seq has been odd for a while: if the writer holding it died, take its
+ * update over. Returns true with *seq at the odd value now owned.
+ */
+bool drm_metadata_recover(struct drm_metadata *meta, uint32_t *seq);
+
+#define DRM_METADATA_WRITE_RETRIES 1000
+
+/*
+ * Apply update to the mutable state. Writers exclude each other by
+ * flipping seq to odd; readers retry instead of waiting. -EBUSY if
+ * another writer holds it for too long and is still alive.
+ */
+template <typename F>
+int drm_metadata_write(struct drm_metadata *meta, F update)
+{
+    uint32_t seq = meta->seq.load(std::memory_order_relaxed);
+    for (int retries = 0; ; ) {
+        if (!(seq & 1)) {
+            if (meta->seq.compare_exchange_weak(seq, seq + 1,
+                    std::memory_order_acquire, std::memory_order_relaxed)) {
+                seq++;
+                break;
+            }
+            continue;
+        }
+        if (++retries >= DRM_METADATA_WRITE_RETRIES) {
+            if (!drm_metadata_recover(meta, &seq))
+                return -EBUSY;
+            break;
+        }
+        sched_yield();
+        seq = meta->seq.load(std::memory_order_relaxed);
+    }
+    drm_metadata_claim(meta);
+    std::atomic_thread_fence(std::memory_order_release);
+    update(&meta->state);
+    drm_metadata_unclaim(meta);
+    meta->seq.store(seq + 1, std::memory_order_release);
+    return 0;
+}
@@ -35,6 +35,11 @@ bool ComposerClient::init() {
         LOG(ERROR) << "failed to create composer resources";
         return false;
     }
+    // the display keeps fbs of cached buffers, they go with the buffers
+    IComposerHal* hal = mHal;
+    mResources->setBufferListener(
+            [hal](buffer_handle_t buffer) { return hal->getBufferKey(buffer); },
+            [hal](uint64_t key) { hal->releaseBuffer(key); });
 
     mCommandEngine = std::make_unique<ComposerCommandEngine>(mHal, mResources.get());
     if (mCommandEngine == nullptr) {
@@ -112,9 +117,7 @@ ndk::ScopedAStatus ComposerClient::executeCommands(const std::vector<DisplayComm
 
 ndk::ScopedAStatus ComposerClient::getActiveConfig(int64_t display, int32_t* config) {
     DEBUG_FUNC();
-    config = nullptr;
-    auto err = (0 == display || 1 == display)
-            ? HWC2_ERROR_NONE : HWC2_ERROR_BAD_DISPLAY;
+    auto err = mHal->getActiveConfig(display, config);
     return TO_BINDER_STATUS(err);
 }
 
@@ -155,22 +158,17 @@ ndk::ScopedAStatus ComposerClient::getDisplayAttribute(int64_t display, int32_t
     return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::getDisplayCapabilities(int64_t /*display*/,
-                                                          std::vector<DisplayCapability>* /*caps*/) {
+ndk::ScopedAStatus ComposerClient::getDisplayCapabilities(int64_t display,
+                                                          std::vector<DisplayCapability>* caps) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
+    auto err = mHal->getDisplayCapabilities(display, caps);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getDisplayConfigs(int64_t display,
                                                      std::vector<int32_t>* configs) {
     DEBUG_FUNC();
-    std::vector<int32_t> hwcConfigs(1);
-    auto err = HWC2_ERROR_BAD_DISPLAY;
-    if (0 == display || 1 == display) {
-        hwcConfigs.data()[0]= 0;
-        err = HWC2_ERROR_NONE;
-    }
-    h2a::translate(hwcConfigs, *configs);
+    auto err = mHal->getDisplayConfigs(display, configs);
     return TO_BINDER_STATUS(err);
 }
 
@@ -292,16 +290,18 @@ ndk::ScopedAStatus ComposerClient::registerCallback(
     return ndk::ScopedAStatus::ok();
 }
 
-ndk::ScopedAStatus ComposerClient::setActiveConfig(int64_t /*display*/, int32_t /*config*/) {
+ndk::ScopedAStatus ComposerClient::setActiveConfig(int64_t display, int32_t config) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setActiveConfig(display, config);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setActiveConfigWithConstraints(
-        int64_t /*display*/, int32_t /*config*/, const VsyncPeriodChangeConstraints& /*constraints*/,
-        VsyncPeriodChangeTimeline* /*timeline*/) {
+        int64_t display, int32_t config, const VsyncPeriodChangeConstraints& constraints,
+        VsyncPeriodChangeTimeline* timeline) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setActiveConfigWithConstraints(display, config, constraints, timeline);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setBootDisplayConfig(int64_t /*display*/, int32_t /*config*/) {
@@ -394,9 +394,10 @@ ndk::ScopedAStatus ComposerClient::setVsyncEnabled(int64_t display, bool enabled
     return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::setIdleTimerEnabled(int64_t /*display*/, int32_t /*timeout*/) {
+ndk::ScopedAStatus ComposerClient::setIdleTimerEnabled(int64_t display, int32_t timeout) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setIdleTimerEnabled(display, timeout);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setRefreshRateChangedCallbackDebugEnabled(int64_t /*display*/,
@@ -17,7 +17,6 @@
 #define LOG_TAG "composer-CommandEngine"
 
 #include <set>
-#include <sync/sync.h>
 
 #include "ComposerCommandEngine.h"
 #include "Util.h"
@@ -210,8 +209,8 @@ void ComposerCommandEngine::executeSetOutputBuffer(uint64_t display, const Buffe
 }
 
 void ComposerCommandEngine::executeSetExpectedPresentTimeInternal(
-        int64_t /*display*/, const std::optional<ClockMonotonicTimestamp> /*expectedPresentTime*/) {
-   //mHal->setExpectedPresentTime(display, expectedPresentTime);
+        int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime) {
+    mHal->setExpectedPresentTime(display, expectedPresentTime);
 }
 
 void ComposerCommandEngine::executeValidateDisplay(
@@ -233,6 +232,13 @@ void ComposerCommandEngine::executePresentOrValidateDisplay(
         int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime) {
     executeSetExpectedPresentTimeInternal(display, expectedPresentTime);
 
+    // First try to present as is, the device refuses with NOT_VALIDATED
+    // when more than buffers changed since the last validate
+    if (!mResources->mustValidateDisplay(display) && !executePresentDisplay(display)) {
+        mWriter->setPresentOrValidateResult(display, PresentOrValidate::Result::Presented);
+        return;
+    }
+
     // Fallback to validate
     int err = executeValidateDisplayInternal(display);
     if (!err) {
@@ -261,13 +267,13 @@ int ComposerCommandEngine::executePresentDisplay(int64_t display) {
     return err;
 }
 
-void ComposerCommandEngine::executeSetLayerCursorPosition(int64_t /*display*/, int64_t /*layer*/,
-                                       const common::Point& /*cursorPosition*/) {
-    /*auto err = mHal->setLayerCursorPosition(display, layer, cursorPosition.x, cursorPosition.y);
+void ComposerCommandEngine::executeSetLayerCursorPosition(int64_t display, int64_t layer,
+                                       const common::Point& cursorPosition) {
+    auto err = mHal->setLayerCursorPosition(display, layer, cursorPosition.x, cursorPosition.y);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerBuffer(int64_t display, int64_t layer,
@@ -282,39 +288,34 @@ void ComposerCommandEngine::executeSetLayerBuffer(int64_t display, int64_t layer
                                           handle, hwcBuffer, bufferReleaser.get());
 
     if (!err) {
-        int32_t fence;
-        a2h::translate(buffer.fence, fence);
-        if (fence >= 0) {
-            sync_wait(fence, -1);
-            close(fence);
-        }
-        /*err = mHal->setLayerBuffer(display, layer, hwcBuffer, buffer.fence);
+        // the fence is kept with the layer, nothing waits on it here
+        err = mHal->setLayerBuffer(display, layer, hwcBuffer, buffer.fence);
         if (err) {
             LOG(ERROR) << __func__ << ": setLayerBuffer err " << err;
             mWriter->setError(mCommandIndex, err);
-        }*/
+        }
     } else {
         LOG(ERROR) << __func__ << ": getLayerBuffer err " << err;
         mWriter->setError(mCommandIndex, err);
     }
 }
 
-void ComposerCommandEngine::executeSetLayerSurfaceDamage(int64_t /*display*/, int64_t /*layer*/,
-                              const std::vector<std::optional<common::Rect>>& /*damage*/) {
-    /*auto err = mHal->setLayerSurfaceDamage(display, layer, damage);
+void ComposerCommandEngine::executeSetLayerSurfaceDamage(int64_t display, int64_t layer,
+                              const std::vector<std::optional<common::Rect>>& damage) {
+    auto err = mHal->setLayerSurfaceDamage(display, layer, damage);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerBlendMode(int64_t /*display*/, int64_t /*layer*/,
-                                                     const ParcelableBlendMode& /*blendMode*/) {
-    /*auto err = mHal->setLayerBlendMode(display, layer, blendMode.blendMode);
+void ComposerCommandEngine::executeSetLayerBlendMode(int64_t display, int64_t layer,
+                                                     const ParcelableBlendMode& blendMode) {
+    auto err = mHal->setLayerBlendMode(display, layer, blendMode.blendMode);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerColor(int64_t /*display*/, int64_t /*layer*/,
@@ -335,31 +336,31 @@ void ComposerCommandEngine::executeSetLayerComposition(int64_t display, int64_t
     }
 }
 
-void ComposerCommandEngine::executeSetLayerDataspace(int64_t /*display*/, int64_t /*layer*/,
-                                                     const ParcelableDataspace& /*dataspace*/) {
-    /*auto err = mHal->setLayerDataspace(display, layer, dataspace.dataspace);
+void ComposerCommandEngine::executeSetLayerDataspace(int64_t display, int64_t layer,
+                                                     const ParcelableDataspace& dataspace) {
+    auto err = mHal->setLayerDataspace(display, layer, dataspace.dataspace);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerDisplayFrame(int64_t /*display*/, int64_t /*layer*/,
-                                                        const common::Rect& /*rect*/) {
-    /*auto err = mHal->setLayerDisplayFrame(display, layer, rect);
+void ComposerCommandEngine::executeSetLayerDisplayFrame(int64_t display, int64_t layer,
+                                                        const common::Rect& rect) {
+    auto err = mHal->setLayerDisplayFrame(display, layer, rect);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerPlaneAlpha(int64_t /*display*/, int64_t /*layer*/,
-                                                      const PlaneAlpha& /*planeAlpha*/) {
-    /*auto err = mHal->setLayerPlaneAlpha(display, layer, planeAlpha.alpha);
+void ComposerCommandEngine::executeSetLayerPlaneAlpha(int64_t display, int64_t layer,
+                                                      const PlaneAlpha& planeAlpha) {
+    auto err = mHal->setLayerPlaneAlpha(display, layer, planeAlpha.alpha);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerSidebandStream(int64_t display, int64_t layer,
@@ -379,22 +380,22 @@ void ComposerCommandEngine::executeSetLayerSidebandStream(int64_t display, int64
     }
 }
 
-void ComposerCommandEngine::executeSetLayerSourceCrop(int64_t /*display*/, int64_t /*layer*/,
-                                                      const common::FRect& /*sourceCrop*/) {
-    /*auto err = mHal->setLayerSourceCrop(display, layer, sourceCrop);
+void ComposerCommandEngine::executeSetLayerSourceCrop(int64_t display, int64_t layer,
+                                                      const common::FRect& sourceCrop) {
+    auto err = mHal->setLayerSourceCrop(display, layer, sourceCrop);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerTransform(int64_t /*display*/, int64_t /*layer*/,
-                                                     const ParcelableTransform& /*transform*/) {
-    /*auto err = mHal->setLayerTransform(display, layer, transform.transform);
+void ComposerCommandEngine::executeSetLayerTransform(int64_t display, int64_t layer,
+                                                     const ParcelableTransform& transform) {
+    auto err = mHal->setLayerTransform(display, layer, transform.transform);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerVisibleRegion(int64_t /*display*/, int64_t /*layer*/,
@@ -406,13 +407,13 @@ void ComposerCommandEngine::executeSetLayerVisibleRegion(int64_t /*display*/, in
     }*/
 }
 
-void ComposerCommandEngine::executeSetLayerZOrder(int64_t /*display*/, int64_t /*layer*/,
-                                                  const ZOrder& /*zOrder*/) {
-    /*auto err = mHal->setLayerZOrder(display, layer, zOrder.z);
+void ComposerCommandEngine::executeSetLayerZOrder(int64_t display, int64_t layer,
+                                                  const ZOrder& zOrder) {
+    auto err = mHal->setLayerZOrder(display, layer, zOrder.z);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerPerFrameMetadata(int64_t /*display*/, int64_t /*layer*/,
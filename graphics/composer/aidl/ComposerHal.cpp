@@ -50,17 +50,32 @@ void ComposerHal::registerEventCallback(ComposerHal::EventCallback* callback) {
 
     mDevice->registerCallback(HWC2_CALLBACK_HOTPLUG, this,
                                reinterpret_cast<hwc2_function_pointer_t>(hotplugHook));
-    mDevice->registerCallback(HWC2_CALLBACK_VSYNC, this,
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_2_4, this,
                                reinterpret_cast<hwc2_function_pointer_t>(vsyncHook));
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_PERIOD_TIMING_CHANGED, this,
+                               reinterpret_cast<hwc2_function_pointer_t>(
+                                       vsyncPeriodTimingChangedHook));
+    mDevice->registerVsyncIdleCallback(this, vsyncIdleHook);
 }
 
 void ComposerHal::unregisterEventCallback() {
     mDevice->registerCallback(HWC2_CALLBACK_HOTPLUG, this, nullptr);
-    mDevice->registerCallback(HWC2_CALLBACK_VSYNC, this, nullptr);
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_2_4, this, nullptr);
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_PERIOD_TIMING_CHANGED, this, nullptr);
+    mDevice->registerVsyncIdleCallback(this, nullptr);
 
     mEventCallback = nullptr;
 }
 
+void ComposerHal::vsyncPeriodTimingChangedHook(hwc2_callback_data_t callbackData,
+                                               hwc2_display_t display,
+                                               hwc_vsync_period_change_timeline_t* hwcTimeline) {
+    auto hal = static_cast<ComposerHal*>(callbackData);
+    VsyncPeriodChangeTimeline timeline;
+    h2a::translate(*hwcTimeline, timeline);
+    hal->mEventCallback->onVsyncPeriodTimingChanged(display, timeline);
+}
+
 int32_t ComposerHal::createLayer(int64_t display, int64_t* outLayer) {
   int32_t err = mDevice->createLayer(display, (hwc2_layer_t *)outLayer);
     return err;
@@ -78,6 +93,34 @@ int32_t ComposerHal::getDisplayAttribute(int64_t display, int32_t config,
     return static_cast<int32_t>(err);
 }
 
+int32_t ComposerHal::getDisplayConfigs(int64_t display, std::vector<int32_t>* outConfigs) {
+    uint32_t count = 0;
+    int32_t err = mDevice->getDisplayConfigs(display, &count, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    std::vector<hwc2_config_t> hwcConfigs(count);
+    err = mDevice->getDisplayConfigs(display, &count, hwcConfigs.data());
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    hwcConfigs.resize(count);
+
+    h2a::translate(hwcConfigs, *outConfigs);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::getActiveConfig(int64_t display, int32_t* outConfig) {
+    hwc2_config_t hwcConfig;
+    int32_t err = mDevice->getActiveConfig(display, &hwcConfig);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    *outConfig = static_cast<int32_t>(hwcConfig);
+    return HWC2_ERROR_NONE;
+}
+
   int32_t ComposerHal::getDisplayName(int64_t display, std::string* outName) {
     uint32_t count = 0;
     int32_t err = mDevice->getDisplayName(display, &count, nullptr);
@@ -99,8 +142,33 @@ int32_t ComposerHal::getDisplayAttribute(int64_t display, int32_t config,
 }
 
 int32_t ComposerHal::getDisplayVsyncPeriod(int64_t display, int32_t* outVsyncPeriod) {
-    return mDevice->getDisplayAttribute(display, 0,
-            HWC2_ATTRIBUTE_VSYNC_PERIOD, outVsyncPeriod);
+    hwc2_vsync_period_t hwcPeriod;
+    int32_t err = mDevice->getDisplayVsyncPeriod(display, &hwcPeriod);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    *outVsyncPeriod = static_cast<int32_t>(hwcPeriod);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::setActiveConfig(int64_t display, int32_t config) {
+    return mDevice->setActiveConfigWithConstraints(display, config, nullptr, nullptr);
+}
+
+int32_t ComposerHal::setActiveConfigWithConstraints(
+        int64_t display, int32_t config, const VsyncPeriodChangeConstraints& constraints,
+        VsyncPeriodChangeTimeline* outTimeline) {
+    hwc_vsync_period_change_constraints_t hwcConstraints;
+    a2h::translate(constraints, hwcConstraints);
+
+    hwc_vsync_period_change_timeline_t hwcTimeline;
+    int32_t err = mDevice->setActiveConfigWithConstraints(display, config, &hwcConstraints,
+                                                          &hwcTimeline);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    h2a::translate(hwcTimeline, *outTimeline);
+    return HWC2_ERROR_NONE;
 }
 
 
@@ -109,18 +177,56 @@ int32_t ComposerHal::setVsyncEnabled(int64_t display, bool enabled) {
     return err;
 }
 
+uint64_t ComposerHal::getBufferKey(buffer_handle_t buffer) {
+    return mDevice->getBufferKey(buffer);
+}
+
+void ComposerHal::releaseBuffer(uint64_t key) {
+    mDevice->releaseBuffer(key);
+}
+
+// SF only hands the idle timer to displays that claim it
+int32_t ComposerHal::getDisplayCapabilities(int64_t display,
+                                            std::vector<DisplayCapability>* outCaps) {
+    bool idleTimer = false;
+    int32_t err = mDevice->getIdleTimerSupport(display, &idleTimer);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    outCaps->clear();
+    if (idleTimer) {
+        outCaps->push_back(DisplayCapability::DISPLAY_IDLE_TIMER);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::setIdleTimerEnabled(int64_t display, int32_t timeout) {
+    int32_t err = mDevice->setIdleTimerEnabled(display, timeout);
+    return err;
+}
+
+int32_t ComposerHal::setExpectedPresentTime(
+        int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime) {
+    int64_t time = expectedPresentTime ? expectedPresentTime->timestampNanos : 0;
+    int32_t err = mDevice->setExpectedPresentTime(display, time);
+    return err;
+}
+
 int32_t ComposerHal::setClientTarget(int64_t display, buffer_handle_t target,
                                  const ndk::ScopedFileDescriptor& fence,
                                  common::Dataspace dataspace,
-   			     const std::vector<common::Rect>& /*damage*/) {
+   			     const std::vector<common::Rect>& damage) {
 
     int32_t hwcFence;
     int32_t hwcDataspace;
+    std::vector<hwc_rect_t> hwcDamage;
     a2h::translate(fence, hwcFence);
     a2h::translate(dataspace, hwcDataspace);
+    a2h::translate(damage, hwcDamage);
+    hwc_region_t region = {hwcDamage.size(), hwcDamage.data()};
     
     int32_t err =
-        mDevice->setClientTarget(display, target, hwcFence, hwcDataspace);
+        mDevice->setClientTarget(display, target, hwcFence, hwcDataspace, region);
     return err;
 }
 
@@ -180,8 +286,21 @@ int32_t ComposerHal::presentDisplay(int64_t display, ndk::ScopedFileDescriptor&
     }
 
     h2a::translate(hwcFence, outPresentFence);    
-    outLayers->resize(0);
-    std::vector<int32_t> hwcFences(0);
+
+    uint32_t count = 0;
+    err = mDevice->getReleaseFences(display, &count, nullptr, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    std::vector<hwc2_layer_t> hwcLayers(count);
+    std::vector<int32_t> hwcFences(count);
+    err = mDevice->getReleaseFences(display, &count, hwcLayers.data(), hwcFences.data());
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    h2a::translate(hwcLayers, *outLayers);
     h2a::translate(hwcFences, *outReleaseFences);
 
     return HWC2_ERROR_NONE;
@@ -192,6 +311,29 @@ int32_t ComposerHal::acceptDisplayChanges(int64_t display) {
     return err;
 }
 
+int32_t ComposerHal::setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                                    const ndk::ScopedFileDescriptor& acquireFence) {
+    int32_t hwcFence;
+    a2h::translate(acquireFence, hwcFence);
+
+    int32_t err = mDevice->setLayerBuffer(display, layer, buffer, hwcFence);
+    return err;
+}
+
+int32_t ComposerHal::setLayerBlendMode(int64_t display, int64_t layer, common::BlendMode mode) {
+    int32_t hwcMode;
+    a2h::translate(mode, hwcMode);
+
+    int32_t err = mDevice->setLayerBlendMode(display, layer, hwcMode);
+    return err;
+}
+
+int32_t ComposerHal::setLayerCursorPosition(int64_t display, int64_t layer, int32_t x,
+                                            int32_t y) {
+    int32_t err = mDevice->setCursorPosition(display, layer, x, y);
+    return err;
+}
+
 int32_t ComposerHal::setLayerCompositionType(int64_t display, int64_t layer, Composition type) {
     int32_t hwcType;
     a2h::translate(type, hwcType);
@@ -200,4 +342,60 @@ int32_t ComposerHal::setLayerCompositionType(int64_t display, int64_t layer, Com
     return err;
 }
 
+int32_t ComposerHal::setLayerDataspace(int64_t display, int64_t layer,
+                                       common::Dataspace dataspace) {
+    int32_t hwcDataspace;
+    a2h::translate(dataspace, hwcDataspace);
+
+    int32_t err = mDevice->setLayerDataspace(display, layer, hwcDataspace);
+    return err;
+}
+
+int32_t ComposerHal::setLayerDisplayFrame(int64_t display, int64_t layer,
+                                          const common::Rect& frame) {
+    hwc_rect_t hwcFrame;
+    a2h::translate(frame, hwcFrame);
+
+    int32_t err = mDevice->setLayerDisplayFrame(display, layer, hwcFrame);
+    return err;
+}
+
+int32_t ComposerHal::setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) {
+    int32_t err = mDevice->setLayerPlaneAlpha(display, layer, alpha);
+    return err;
+}
+
+int32_t ComposerHal::setLayerSourceCrop(int64_t display, int64_t layer,
+                                        const common::FRect& crop) {
+    hwc_frect_t hwcCrop;
+    a2h::translate(crop, hwcCrop);
+
+    int32_t err = mDevice->setLayerSourceCrop(display, layer, hwcCrop);
+    return err;
+}
+
+int32_t ComposerHal::setLayerSurfaceDamage(int64_t display, int64_t layer,
+                                           const std::vector<std::optional<common::Rect>>& damage) {
+    std::vector<hwc_rect_t> hwcDamage;
+    a2h::translate(damage, hwcDamage);
+    hwc_region_t region = {hwcDamage.size(), hwcDamage.data()};
+
+    int32_t err = mDevice->setLayerSurfaceDamage(display, layer, region);
+    return err;
+}
+
+int32_t ComposerHal::setLayerTransform(int64_t display, int64_t layer,
+                                       common::Transform transform) {
+    int32_t hwcTransform;
+    a2h::translate(transform, hwcTransform);
+
+    int32_t err = mDevice->setLayerTransform(display, layer, hwcTransform);
+    return err;
+}
+
+int32_t ComposerHal::setLayerZOrder(int64_t display, int64_t layer, uint32_t z) {
+    int32_t err = mDevice->setLayerZOrder(display, layer, z);
+    return err;
+}
+
 } // namespace aidl::android::hardware::graphics::composer3::impl
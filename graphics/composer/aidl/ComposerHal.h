@@ -39,9 +39,21 @@ class ComposerHal : public IComposerHal {
     int32_t destroyLayer(int64_t display, int64_t layer);
     int32_t getDisplayAttribute(int64_t display, int32_t config,
                               DisplayAttribute attribute, int32_t* outValue) override;
+    int32_t getDisplayCapabilities(int64_t display,
+                                   std::vector<DisplayCapability>* outCaps) override;
+    int32_t getDisplayConfigs(int64_t display, std::vector<int32_t>* outConfigs) override;
+    int32_t getActiveConfig(int64_t display, int32_t* outConfig) override;
     int32_t getDisplayName(int64_t display, std::string* outName)override ;
     int32_t getDisplayVsyncPeriod(int64_t display, int32_t* outVsyncPeriod) override;
+    int32_t setActiveConfig(int64_t display, int32_t config) override;
+    int32_t setActiveConfigWithConstraints(int64_t display, int32_t config,
+                                           const VsyncPeriodChangeConstraints& constraints,
+                                           VsyncPeriodChangeTimeline* outTimeline) override;
     int32_t setVsyncEnabled(int64_t display, bool enabled);
+    int32_t setIdleTimerEnabled(int64_t display, int32_t timeout) override;
+    int32_t setExpectedPresentTime(
+            int64_t display,
+            const std::optional<ClockMonotonicTimestamp> expectedPresentTime) override;
     int32_t setClientTarget(int64_t display, buffer_handle_t target,
                             const ndk::ScopedFileDescriptor& fence, common::Dataspace dataspace,
                             const std::vector<common::Rect>& damage) override;  
@@ -58,7 +70,26 @@ class ComposerHal : public IComposerHal {
   
     int32_t acceptDisplayChanges(int64_t display);
 
+    uint64_t getBufferKey(buffer_handle_t buffer) override;
+    void releaseBuffer(uint64_t key) override;
+
+    int32_t setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                           const ndk::ScopedFileDescriptor& acquireFence) override;
+    int32_t setLayerBlendMode(int64_t display, int64_t layer, common::BlendMode mode) override;
+    int32_t setLayerCursorPosition(int64_t display, int64_t layer, int32_t x, int32_t y) override;
     int32_t setLayerCompositionType(int64_t display, int64_t layer, Composition type) override;
+    int32_t setLayerDataspace(int64_t display, int64_t layer,
+                              common::Dataspace dataspace) override;
+    int32_t setLayerDisplayFrame(int64_t display, int64_t layer,
+                                 const common::Rect& frame) override;
+    int32_t setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) override;
+    int32_t setLayerSourceCrop(int64_t display, int64_t layer,
+                               const common::FRect& crop) override;
+    int32_t setLayerSurfaceDamage(int64_t display, int64_t layer,
+                                  const std::vector<std::optional<common::Rect>>& damage) override;
+    int32_t setLayerTransform(int64_t display, int64_t layer,
+                              common::Transform transform) override;
+    int32_t setLayerZOrder(int64_t display, int64_t layer, uint32_t z) override;
 
   private:
 
@@ -75,6 +106,15 @@ class ComposerHal : public IComposerHal {
         hal->mEventCallback->onVsync(display, timestamp, vsyncPeriodNanos);
     }
 
+    static void vsyncIdleHook(hwc2_callback_data_t callbackData, hwc2_display_t display) {
+        auto hal = static_cast<ComposerHal*>(callbackData);
+        hal->mEventCallback->onVsyncIdle(display);
+    }
+
+    static void vsyncPeriodTimingChangedHook(hwc2_callback_data_t callbackData,
+                                             hwc2_display_t display,
+                                             hwc_vsync_period_change_timeline_t* hwcTimeline);
+
     std::unique_ptr<Hwc2Device> mDevice;
 
     std::unordered_set<hwc2_capability_t> mCapabilities;
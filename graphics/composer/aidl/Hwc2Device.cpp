@@ -20,10 +20,15 @@
 #include <utils/Log.h>
 #include <utils/Trace.h>
 
+#include <string.h>
+#include <inttypes.h>
 #include <sys/prctl.h>
+#include <unistd.h>
+#include <algorithm>
 #include <sstream>
 
 #include <sync/sync.h>
+#include <drm_gralloc.h>
 
 #include "Hwc2Device.h"
 
@@ -35,21 +40,29 @@ Hwc2Device::Hwc2Device()
     mHwcContext = std::make_unique<hwc_context>();
 
     mFbInfo.name = "hwc-v3d";
+    updateInfo();
+    mHwcContext->set_hotplug_callback(hotplugHook, this);
+    mHwcContext->set_idle_callback(idleHook, this);
+
+    mVsyncThread.start(0, mHwcContext->vsync_period(), mHwcContext.get());
+    mIdleTimer.start(this);
+}
+
+void Hwc2Device::updateInfo() {
     mFbInfo.width = mHwcContext->width;
     mFbInfo.height = mHwcContext->height;
     mFbInfo.format = mHwcContext->format;
     mFbInfo.vsync_period_ns = int(1e9 / mHwcContext->fps);
     mFbInfo.xdpi_scaled = int(mHwcContext->xdpi * 1000.0f);
     mFbInfo.ydpi_scaled = int(mHwcContext->ydpi * 1000.0f);
-
-    mVsyncThread.start(0, mFbInfo.vsync_period_ns);
 }
 
 int32_t Hwc2Device::createLayer(hwc2_display_t displayId, hwc2_layer_t* outLayerId) {
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    *outLayerId = addLayer();
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    *outLayerId = mLayers.addLayer();
     setState(State::MODIFIED);
     return HWC2_ERROR_NONE;
 }
@@ -58,7 +71,10 @@ int32_t Hwc2Device::destroyLayer(hwc2_display_t displayId, hwc2_layer_t layerId)
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (removeLayer(layerId)) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    if (mLayers.removeLayer(layerId)) {
+        mChangedLayers.erase(std::remove(mChangedLayers.begin(), mChangedLayers.end(), layerId),
+                             mChangedLayers.end());
         setState(State::MODIFIED);
         return HWC2_ERROR_NONE;
     } else {
@@ -71,11 +87,13 @@ int32_t Hwc2Device::getClientTargetSupport(hwc2_display_t displayId, uint32_t wi
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
     if (dataspace != HAL_DATASPACE_UNKNOWN) {
         return HWC2_ERROR_UNSUPPORTED;
     }
     const auto& info = getInfo();
-    return (info.width == width && info.height == height && info.format == format)
+    // another size is scaled by the primary plane, if the driver can
+    return (info.format == format && mHwcContext->client_target_check(width, height))
             ? HWC2_ERROR_NONE
             : HWC2_ERROR_UNSUPPORTED;
 }
@@ -86,10 +104,11 @@ int32_t Hwc2Device::getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (0 != config) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    hwc_config info;
+    if (mHwcContext->get_config(config, &info)) {
         return HWC2_ERROR_BAD_CONFIG;
     }
-    const auto& info = getInfo();
     switch (intAttribute) {
         case HWC2_ATTRIBUTE_WIDTH:
             *outValue = int32_t(info.width);
@@ -98,13 +117,16 @@ int32_t Hwc2Device::getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t
             *outValue = int32_t(info.height);
             break;
         case HWC2_ATTRIBUTE_VSYNC_PERIOD:
-            *outValue = int32_t(info.vsync_period_ns);
+            *outValue = int32_t(info.vsync_period);
             break;
         case HWC2_ATTRIBUTE_DPI_X:
-            *outValue = int32_t(info.xdpi_scaled);
+            *outValue = int32_t(info.xdpi * 1000.0f);
             break;
         case HWC2_ATTRIBUTE_DPI_Y:
-            *outValue = int32_t(info.ydpi_scaled);
+            *outValue = int32_t(info.ydpi * 1000.0f);
+            break;
+        case HWC2_ATTRIBUTE_CONFIG_GROUP:
+            *outValue = info.group;
             break;
         default:
             return HWC2_ERROR_BAD_PARAMETER;
@@ -125,6 +147,88 @@ int32_t Hwc2Device::getDisplayName(hwc2_display_t displayId, uint32_t* outSize,
     return HWC2_ERROR_NONE;
 }
 
+int32_t Hwc2Device::getDisplayConfigs(hwc2_display_t displayId, uint32_t* outNumConfigs,
+        hwc2_config_t* outConfigs) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t count = mHwcContext->config_count();
+    if (outConfigs) {
+        count = std::min(count, *outNumConfigs);
+        for (uint32_t i = 0; i < count; i++) {
+            outConfigs[i] = i;
+        }
+    }
+    *outNumConfigs = count;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getActiveConfig(hwc2_display_t displayId, hwc2_config_t* outConfig) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    *outConfig = mHwcContext->active_config();
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getDisplayVsyncPeriod(hwc2_display_t displayId,
+        hwc2_vsync_period_t* outVsyncPeriod) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    *outVsyncPeriod = hwc2_vsync_period_t(mHwcContext->vsync_period());
+    return HWC2_ERROR_NONE;
+}
+
+// The new mode goes out with the next frame, so the switch is applied
+// one vblank after that frame's refresh. onVsyncPeriodTimingChanged
+// reports when it actually happened.
+int32_t Hwc2Device::setActiveConfigWithConstraints(hwc2_display_t displayId,
+        hwc2_config_t config, hwc_vsync_period_change_constraints_t* constraints,
+        hwc_vsync_period_change_timeline_t* outTimeline) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    hwc_config info, active;
+    if (mHwcContext->get_config(config, &info) ||
+            mHwcContext->get_config(mHwcContext->active_config(), &active)) {
+        return HWC2_ERROR_BAD_CONFIG;
+    }
+    if (constraints && constraints->seamlessRequired) {
+        if (info.group != active.group) {
+            return HWC2_ERROR_SEAMLESS_NOT_ALLOWED;
+        }
+        if (!mHwcContext->config_seamless(config)) {
+            return HWC2_ERROR_SEAMLESS_NOT_POSSIBLE;
+        }
+    }
+
+    int64_t oldPeriod = mHwcContext->vsync_period();
+    if (config != mHwcContext->active_config()) {
+        mHwcContext->set_config(config);
+        updateInfo();
+        // a repeat would keep the old mode on screen
+        mFrameChanged = true;
+        // tested against the old mode, and maybe another framebuffer size
+        mPlaneCache.clear();
+        mPlanesTested = false;
+        setState(State::MODIFIED);
+    }
+    int64_t desired = constraints ? constraints->desiredTimeNanos : 0;
+    mConfigPresentTime = desired;
+
+    if (outTimeline) {
+        int64_t refreshTime = std::max(VsyncThread::now(), desired);
+        outTimeline->refreshRequired = true;
+        outTimeline->refreshTimeNanos = refreshTime;
+        outTimeline->newVsyncAppliedTimeNanos = refreshTime + oldPeriod;
+    }
+    return HWC2_ERROR_NONE;
+}
+
 int32_t Hwc2Device::setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled) {
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
@@ -133,21 +237,102 @@ int32_t Hwc2Device::setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled
     return HWC2_ERROR_NONE;
 }
 
+int32_t Hwc2Device::setIdleTimerEnabled(hwc2_display_t displayId, int32_t timeoutMs) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (timeoutMs < 0) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    if (!mHwcContext->idle_supported()) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    mIdleTimer.setTimeout(int64_t(timeoutMs) * 1'000'000);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getIdleTimerSupport(hwc2_display_t displayId, bool* outSupport) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    *outSupport = mHwcContext->idle_supported();
+    return HWC2_ERROR_NONE;
+}
+
+uint64_t Hwc2Device::getBufferKey(buffer_handle_t buffer) {
+    return mHwcContext->buffer_key(buffer);
+}
+
+void Hwc2Device::releaseBuffer(uint64_t key) {
+    mHwcContext->release_buffer(key);
+}
+
+// The picture stays, at the lowest refresh rate of its size. The next
+// present brings the active config back, see presentDisplay(). SF only
+// hears of it once the drop was committed, see onIdleCommitted().
+bool Hwc2Device::onIdle() {
+    int err = mHwcContext->hwc_idle();
+    if (err == -EBUSY) {
+        return false;
+    }
+    if (err) {
+        // the rate stays, SF must not think vsync stopped
+        ALOGW("onIdle() %s", strerror(-err));
+    }
+    return true;
+}
+
+void Hwc2Device::idleHook(void* data) {
+    static_cast<Hwc2Device*>(data)->mIdleTimer.committed();
+}
+
+void Hwc2Device::onIdleCommitted() {
+    ALOGV("onIdleCommitted() refresh rate dropped");
+    mVsyncThread.setIdle(true);
+    std::lock_guard<std::mutex> lock(mIdleCallbackLock);
+    if (mVsyncIdleCallback) {
+        mVsyncIdleCallback(mVsyncIdleCallbackData, 0);
+    }
+}
+
+
+int32_t Hwc2Device::setExpectedPresentTime(hwc2_display_t displayId, int64_t time) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    mExpectedPresentTime = time;
+    return HWC2_ERROR_NONE;
+}
 
 int32_t Hwc2Device::setClientTarget(hwc2_display_t displayId, buffer_handle_t target,
-        int32_t acquireFence, int32_t dataspace) {
+        int32_t acquireFence, int32_t dataspace, hwc_region_t damage) {
     ALOGV("setClientTarget(%p, %d)", target, acquireFence);
-    if (acquireFence >= 0) {
-        sync_wait(acquireFence, -1);
-        close(acquireFence);
-    }
+    // handed to the commit, the kernel or the commit thread waits on it
+    ::android::base::unique_fd fence(acquireFence);
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
     if (dataspace != HAL_DATASPACE_UNKNOWN) {
         return HWC2_ERROR_BAD_PARAMETER;
     }
+    if (target && target != mBuffer) {
+        // a new slot buffer, its fb is ready before the present
+        mHwcContext->import_buffer(target);
+    }
+    // the same buffer is only redrawn if it comes with damage
+    bool noDamage = damage.numRects == 0 ||
+            (damage.numRects == 1 && damage.rects[0].left == damage.rects[0].right &&
+             damage.rects[0].top == damage.rects[0].bottom);
+    if (target != mBuffer || !noDamage) {
+        mFrameChanged = true;
+    }
     mBuffer = target;
+    mBufferAcquireFence = std::move(fence);
+    mBufferDamage.assign(damage.rects, damage.rects + damage.numRects);
     return HWC2_ERROR_NONE;
 }
 
@@ -156,8 +341,9 @@ int32_t Hwc2Device::validateDisplay(hwc2_display_t displayId, uint32_t* outNumTy
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    const auto& dirtyLayers = getDirtyLayers();
-    *outNumTypes = dirtyLayers.size();
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    assignPlanes();
+    *outNumTypes = mChangedLayers.size();
     *outNumRequests = 0;
     ALOGV("validateDisplay() %u types", *outNumTypes);
     if (*outNumTypes > 0) {
@@ -173,12 +359,55 @@ int32_t Hwc2Device::presentDisplay(hwc2_display_t displayId, int32_t* outRetireF
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
     if (getState() != State::VALIDATED) {
         return HWC2_ERROR_NOT_VALIDATED;
     }
     ALOGV("presentDisplay(%p)", mBuffer);
+    int64_t presentTime = std::max(std::exchange(mExpectedPresentTime, 0),
+                                   std::exchange(mConfigPresentTime, 0));
+    if (mIdleTimer.present()) {
+        mVsyncThread.setIdle(false);
+    }
+
+    // same client target, same layers: the picture on screen stays
+    bool changed = mLayers.takeFrameChanges() != 0 || mFrameChanged;
+    mFrameChanged = false;
+    if (!changed) {
+        ALOGV("presentDisplay() frame repeated");
+        mBufferAcquireFence.reset();
+        for (auto& fence : mLayers.acquireFence) {
+            fence.reset();
+        }
+        mReleasedLayers.clear();
+        mReleaseFences.clear();
+        int err = mHwcContext->hwc_repeat(outRetireFence, presentTime);
+        if (err != -ENOTSUP) {
+            return err ? HWC2_ERROR_NO_RESOURCES : HWC2_ERROR_NONE;
+        }
+        // no fence for a repeat, commit the same frame again for one
+    }
+
+    hwc_frame frame;
+    buildFrame(&frame, true);
+    frame.present_time = presentTime;
+
     *outRetireFence = -1;
-    mHwcContext->hwc_post(mBuffer, outRetireFence);
+    if (frame.planes.empty() || mHwcContext->hwc_post(&frame, outRetireFence)) {
+        // nothing went out, the next frame can't be a repeat
+        mFrameChanged = true;
+    }
+
+    // what was scanned out before is free once this frame is on screen
+    mReleasedLayers.clear();
+    mReleaseFences.clear();
+    for (uint32_t slot = 0; slot < mLayers.size(); slot++) {
+        if (mLayers.onScreen[slot]) {
+            mReleasedLayers.push_back(mLayers.ids[slot]);
+            mReleaseFences.emplace_back(*outRetireFence >= 0 ? dup(*outRetireFence) : -1);
+        }
+        mLayers.onScreen[slot] = mLayers.plane[slot] >= 0;
+    }
     return HWC2_ERROR_NONE;
 }
 
@@ -186,10 +415,14 @@ int32_t Hwc2Device::acceptDisplayChanges(hwc2_display_t displayId) {
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
     if (getState() == State::MODIFIED) {
         return HWC2_ERROR_NOT_VALIDATED;
     }
-    clearDirtyLayers();
+    for (auto id : mChangedLayers) {
+        mLayers.acceptCompositionType(mLayers.find(id));
+    }
+    mChangedLayers.clear();
     setState(State::VALIDATED);
     return HWC2_ERROR_NONE;
 }
@@ -199,37 +432,200 @@ int32_t Hwc2Device::getChangedCompositionTypes(hwc2_display_t displayId, uint32_
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
+    std::lock_guard<std::mutex> lock(mDisplayLock);
     if (getState() == State::MODIFIED) {
         return HWC2_ERROR_NOT_VALIDATED;
     }
-    const auto& dirtyLayers = getDirtyLayers();
     if (outLayers && outTypes) {
-        *outNumElements = std::min(*outNumElements, uint32_t(dirtyLayers.size()));
-        auto iter = dirtyLayers.cbegin();
+        *outNumElements = std::min(*outNumElements, uint32_t(mChangedLayers.size()));
         for (uint32_t i = 0; i < *outNumElements; i++) {
-            outLayers[i] = *iter++;
-            outTypes[i] = HWC2_COMPOSITION_CLIENT;
+            outLayers[i] = mChangedLayers[i];
+            outTypes[i] = mLayers.validatedType[mLayers.find(outLayers[i])];
         }
     } else {
-        *outNumElements = dirtyLayers.size();
+        *outNumElements = mChangedLayers.size();
     }
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
-        int32_t intType) {
+int32_t Hwc2Device::getReleaseFences(hwc2_display_t displayId, uint32_t* outNumElements,
+        hwc2_layer_t* outLayers, int32_t* outFences) {
     if (0 != displayId && 1 != displayId ) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (!markLayerDirty(layerId, intType != HWC2_COMPOSITION_CLIENT)) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    if (outLayers && outFences) {
+        *outNumElements = std::min(*outNumElements, uint32_t(mReleasedLayers.size()));
+        for (uint32_t i = 0; i < *outNumElements; i++) {
+            outLayers[i] = mReleasedLayers[i];
+            outFences[i] = mReleaseFences[i].release();
+        }
+    } else {
+        *outNumElements = mReleasedLayers.size();
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setCursorPosition(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t x, int32_t y) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.compositionType[slot] != HWC2_COMPOSITION_CURSOR) {
         return HWC2_ERROR_BAD_LAYER;
     }
-    setState(State::MODIFIED);
+    mLayers.setCursorPosition(slot, x, y);
+    // no new frame: the cursor plane moves on its own
+    if (mLayers.plane[slot] >= 0 && mLayers.plane[slot] == mHwcContext->cursor_plane()) {
+        mHwcContext->move_cursor(x, y);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerBuffer(hwc2_display_t displayId, hwc2_layer_t layerId,
+        buffer_handle_t buffer, int32_t acquireFence) {
+    ::android::base::unique_fd fence(acquireFence);
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setBuffer(slot, buffer, std::move(fence))) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerBlendMode(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t mode) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setBlendMode(slot, mode)) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t intType) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setCompositionType(slot, intType)) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerDataspace(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t dataspace) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setDataspace(slot, dataspace)) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerDisplayFrame(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_rect_t frame) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setDisplayFrame(slot, frame)) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerPlaneAlpha(hwc2_display_t displayId, hwc2_layer_t layerId,
+        float alpha) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setPlaneAlpha(slot, alpha)) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerSurfaceDamage(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_region_t damage) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    mLayers.setSurfaceDamage(slot, damage);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerSourceCrop(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_frect_t crop) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setSourceCrop(slot, crop)) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t transform) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setTransform(slot, transform)) {
+        setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerZOrder(hwc2_display_t displayId, hwc2_layer_t layerId, uint32_t z) {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
+    uint32_t slot;
+    int32_t err = getLayer(displayId, layerId, &slot);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    if (mLayers.setZ(slot, z)) {
+        setState(State::MODIFIED);
+    }
     return HWC2_ERROR_NONE;
 }
 
 void Hwc2Device::dump(uint32_t* outSize, char* outBuffer)
 {
+    std::lock_guard<std::mutex> lock(mDisplayLock);
     if (outBuffer != nullptr) {
         auto copiedBytes = mDumpString.copy(outBuffer, *outSize);
         *outSize = static_cast<uint32_t>(copiedBytes);
@@ -238,6 +634,28 @@ void Hwc2Device::dump(uint32_t* outSize, char* outBuffer)
 
     std::stringstream output;
     output << "-- hwc-v3d --\n";
+    output << "  " << mHwcContext->plane_count() << " planes, " << mLayers.size()
+           << " layers\n";
+    for (uint32_t slot = 0; slot < mLayers.size(); slot++) {
+        output << "    layer " << mLayers.ids[slot] << " z " << mLayers.z[slot] << " type "
+               << mLayers.validatedType[slot] << " plane " << mLayers.plane[slot] << "\n";
+    }
+    // commits of planes without IN_FENCE_FD wait for the acquire fences here
+    uint64_t waits[DRM_FENCE_WAIT_BUCKETS];
+    drm_fence_wait_histogram(waits);
+    output << "  fence waits:";
+    int64_t limit = 64;
+    for (int i = 0; i < DRM_FENCE_WAIT_BUCKETS; i++, limit <<= 1) {
+        if (!waits[i]) {
+            continue;
+        }
+        if (i < DRM_FENCE_WAIT_BUCKETS - 1) {
+            output << " <" << limit << "us:" << waits[i];
+        } else {
+            output << " >=" << (limit >> 1) << "us:" << waits[i];
+        }
+    }
+    output << "\n";
     mDumpString = output.str();
     *outSize = static_cast<uint32_t>(mDumpString.size());
 }
@@ -245,16 +663,23 @@ void Hwc2Device::dump(uint32_t* outSize, char* outBuffer)
 int32_t Hwc2Device::registerCallback(int32_t intDesc, hwc2_callback_data_t callbackData,
         hwc2_function_pointer_t pointer) {
     switch (intDesc) {
-        case HWC2_CALLBACK_HOTPLUG:
-            if (pointer) {
-                reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer)(callbackData, 0,
-                                                            HWC2_CONNECTION_CONNECTED);
+        case HWC2_CALLBACK_HOTPLUG: {
+            std::lock_guard<std::mutex> lock(mHotplugLock);
+            mHotplugCallback = reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer);
+            mHotplugCallbackData = callbackData;
+            if (mHotplugCallback) {
+                mHotplugCallback(callbackData, 0, HWC2_CONNECTION_CONNECTED);
             }
             break;
+        }
         case HWC2_CALLBACK_REFRESH:
             break;
-        case HWC2_CALLBACK_VSYNC:
-            mVsyncThread.setCallback(reinterpret_cast<HWC2_PFN_VSYNC>(pointer), callbackData);
+        case HWC2_CALLBACK_VSYNC_2_4:
+            mVsyncThread.setCallback(reinterpret_cast<HWC2_PFN_VSYNC_2_4>(pointer), callbackData);
+            break;
+        case HWC2_CALLBACK_VSYNC_PERIOD_TIMING_CHANGED:
+            mVsyncThread.setPeriodCallback(
+                    reinterpret_cast<HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED>(pointer), callbackData);
             break;
         default:
             return HWC2_ERROR_BAD_PARAMETER;
@@ -263,45 +688,292 @@ int32_t Hwc2Device::registerCallback(int32_t intDesc, hwc2_callback_data_t callb
     return HWC2_ERROR_NONE;
 }
 
+void Hwc2Device::hotplugHook(void* data) {
+    static_cast<Hwc2Device*>(data)->onHotplug();
+}
 
-hwc2_layer_t Hwc2Device::addLayer() {
-    hwc2_layer_t id = ++mNextLayerId;
-
-    mLayers.insert(id);
-    mDirtyLayers.insert(id);
-
-    return id;
+// The client frees the buffers it cached for the display as soon as it
+// hears of the hotplug, so nothing may point at them by then. The new
+// configs are in place before SF asks for them.
+void Hwc2Device::onHotplug() {
+    {
+        std::lock_guard<std::mutex> lock(mDisplayLock);
+        mBuffer = nullptr;
+        mBufferAcquireFence.reset();
+        mLayers.dropBuffers();
+        mHwcContext->drop_frames();
+        if (mHwcContext->apply_hotplug()) {
+            updateInfo();
+        }
+        mPlaneCache.clear();
+        mPlanesTested = false;
+        mFrameChanged = true;
+        setState(State::MODIFIED);
+    }
+    std::lock_guard<std::mutex> lock(mHotplugLock);
+    if (mHotplugCallback) {
+        mHotplugCallback(mHotplugCallbackData, 0, HWC2_CONNECTION_CONNECTED);
+    }
 }
 
-bool Hwc2Device::removeLayer(hwc2_layer_t layer) {
-    mDirtyLayers.erase(layer);
-    return mLayers.erase(layer);
+void Hwc2Device::registerVsyncIdleCallback(hwc2_callback_data_t callbackData,
+        PFN_VSYNC_IDLE callback) {
+    std::lock_guard<std::mutex> lock(mIdleCallbackLock);
+    mVsyncIdleCallback = callback;
+    mVsyncIdleCallbackData = callbackData;
 }
 
-bool Hwc2Device::hasLayer(hwc2_layer_t layer) const {
-    return mLayers.count(layer) > 0;
+
+int32_t Hwc2Device::getLayer(hwc2_display_t displayId, hwc2_layer_t layerId,
+        uint32_t* outSlot) {
+    if (0 != displayId && 1 != displayId ) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    int32_t slot = mLayers.find(layerId);
+    if (slot < 0) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    *outSlot = uint32_t(slot);
+    return HWC2_ERROR_NONE;
 }
 
-bool Hwc2Device::markLayerDirty(hwc2_layer_t layer, bool dirty) {
-    if (mLayers.count(layer) == 0) {
+bool Hwc2Device::getPlaneState(uint32_t slot, uint32_t plane, kms_plane_state* outState) const {
+    // cursor layers move without a frame, which only the cursor plane can do
+    int32_t type = int32_t(plane) == mHwcContext->cursor_plane() ? HWC2_COMPOSITION_CURSOR
+                                                                 : HWC2_COMPOSITION_DEVICE;
+    if (mLayers.compositionType[slot] != type || mLayers.transform[slot] != 0) {
+        return false;
+    }
+    // planes scan out as is, no color conversion
+    int32_t dataspace = mLayers.dataspace[slot];
+    if (dataspace != HAL_DATASPACE_UNKNOWN && dataspace != HAL_DATASPACE_SRGB &&
+            dataspace != HAL_DATASPACE_V0_SRGB) {
+        return false;
+    }
+    buffer_handle_t buffer = mLayers.buffer[slot];
+    if (!buffer || private_handle_t::validate(buffer) < 0) {
+        return false;
+    }
+    const hwc_rect_t& frame = mLayers.displayFrame[slot];
+    const hwc_frect_t& crop = mLayers.sourceCrop[slot];
+    if (frame.right <= frame.left || frame.bottom <= frame.top ||
+            crop.left < 0.0f || crop.top < 0.0f ||
+            crop.right <= crop.left || crop.bottom <= crop.top) {
         return false;
     }
 
-    if (dirty) {
-        mDirtyLayers.insert(layer);
-    } else {
-        mDirtyLayers.erase(layer);
+    outState->plane = plane;
+    outState->hnd = reinterpret_cast<const private_handle_t*>(buffer);
+    outState->fb_id = 0;
+    outState->acquire_fence = -1;
+    outState->source = mLayers.ids[slot];
+    outState->damage.clear();
+    outState->crtc_x = frame.left;
+    outState->crtc_y = frame.top;
+    outState->crtc_w = uint32_t(frame.right - frame.left);
+    outState->crtc_h = uint32_t(frame.bottom - frame.top);
+    outState->src_x = uint32_t(crop.left * 65536.0f);
+    outState->src_y = uint32_t(crop.top * 65536.0f);
+    outState->src_w = uint32_t((crop.right - crop.left) * 65536.0f);
+    outState->src_h = uint32_t((crop.bottom - crop.top) * 65536.0f);
+    outState->alpha =
+            uint16_t(std::clamp(mLayers.planeAlpha[slot], 0.0f, 1.0f) * 0xffff + 0.5f);
+    switch (mLayers.blendMode[slot]) {
+        case HWC2_BLEND_MODE_PREMULTIPLIED:
+            outState->blend = KMS_BLEND_PREMULTI;
+            break;
+        case HWC2_BLEND_MODE_COVERAGE:
+            outState->blend = KMS_BLEND_COVERAGE;
+            break;
+        default:
+            outState->blend = KMS_BLEND_NONE;
+            break;
     }
+    return mHwcContext->plane_check(outState);
+}
 
+// The client's rects as they are, hwc_context knows when they don't apply.
+static void setDamage(const std::vector<hwc_rect_t>& rects, kms_plane_state* state) {
+    state->damage.clear();
+    for (const hwc_rect_t& rect : rects) {
+        state->damage.push_back({rect.left, rect.top, rect.right, rect.bottom});
+    }
+}
+
+// Planes of the layers the last validate picked, bottom to top. The client
+// target stands in for the primary plane unless a layer took it; before
+// validate it is last frame's, which has the same size and format.
+bool Hwc2Device::buildFrame(hwc_frame* frame, bool takeFences) {
+    std::vector<uint32_t> planeLayers;
+    for (uint32_t slot = 0; slot < mLayers.size(); slot++) {
+        if (mLayers.plane[slot] >= 0) {
+            planeLayers.push_back(slot);
+        }
+    }
+    std::sort(planeLayers.begin(), planeLayers.end(),
+              [this](uint32_t a, uint32_t b) { return mLayers.plane[a] < mLayers.plane[b]; });
+
+    frame->planes.clear();
+    kms_plane_state state{};
+    if (planeLayers.empty() || mLayers.plane[planeLayers[0]] != 0) {
+        if (private_handle_t::validate(mBuffer) < 0) {
+            return false;
+        }
+        auto hnd = reinterpret_cast<const private_handle_t*>(mBuffer);
+        state.plane = 0;
+        state.hnd = hnd;
+        state.acquire_fence = takeFences ? mBufferAcquireFence.release() : -1;
+        state.crtc_w = mFbInfo.width;
+        state.crtc_h = mFbInfo.height;
+        state.src_w = uint32_t(hnd->width) << 16;
+        state.src_h = uint32_t(hnd->height) << 16;
+        state.alpha = 0xffff;
+        state.blend = KMS_BLEND_NONE;
+        // layer ids start at 1
+        state.source = 0;
+        if (takeFences) {
+            setDamage(mBufferDamage, &state);
+        }
+        frame->planes.push_back(state);
+    } else if (takeFences) {
+        mBufferAcquireFence.reset();
+    }
+    for (uint32_t slot : planeLayers) {
+        if (!getPlaneState(slot, mLayers.plane[slot], &state)) {
+            ALOGE("buildFrame() layer lost plane %d", mLayers.plane[slot]);
+            continue;
+        }
+        state.acquire_fence = takeFences ? mLayers.acquireFence[slot].release() : -1;
+        if (takeFences) {
+            setDamage(mLayers.damage[slot], &state);
+        }
+        frame->planes.push_back(state);
+    }
     return true;
 }
 
-const std::unordered_set<hwc2_layer_t>& Hwc2Device::getDirtyLayers() const {
-    return mDirtyLayers;
+// The geometry records of the layers in z order, see LayerStore::Geometry.
+std::string Hwc2Device::getGeometryKey() const {
+    const auto& sorted = mLayers.sorted();
+    std::string key;
+    key.reserve(sorted.size() * sizeof(LayerStore::Geometry));
+    for (uint32_t slot : sorted) {
+        key.append(reinterpret_cast<const char*>(&mLayers.geometry[slot]),
+                   sizeof(LayerStore::Geometry));
+    }
+    return key;
+}
+
+// Starts from the largest assignment the planes' static checks allow and
+// asks the driver with a TEST_ONLY commit, handing the bottom-most device
+// layer to the client after each failure. Returns false if the driver
+// couldn't be asked, so the result must not be cached.
+bool Hwc2Device::searchPlanes(const std::vector<uint32_t>& sorted) {
+    hwc_frame frame;
+    while (true) {
+        auto lowest = std::find_if(sorted.begin(), sorted.end(),
+                                   [this](uint32_t slot) { return mLayers.plane[slot] >= 0; });
+        if (lowest == sorted.end()) {
+            // client composition only, that always works
+            return true;
+        }
+        int err = buildFrame(&frame, false) ? mHwcContext->test_frame(&frame) : -EAGAIN;
+        if (!err) {
+            return true;
+        }
+        if (err == -EAGAIN) {
+            std::fill(mLayers.plane.begin(), mLayers.plane.end(), -1);
+            return false;
+        }
+        ALOGV("searchPlanes() layer %" PRIu64 " on plane %d failed (%d)", mLayers.ids[*lowest],
+              mLayers.plane[*lowest], err);
+        mLayers.plane[*lowest] = -1;
+    }
+}
+
+// With nothing but buffers changed since the last conclusive validate the
+// planes stay as they are. Geometry seen before reuses its tested
+// assignment without an ioctl.
+void Hwc2Device::assignPlanes() {
+    bool changed = mLayers.dirtyBits() & LayerStore::DIRTY_NEEDS_VALIDATE;
+    mLayers.refresh();
+    const auto& sorted = mLayers.sorted();
+
+    if (changed || !mPlanesTested) {
+        // the same layers may end up on other planes than last frame
+        mFrameChanged = true;
+        std::fill(mLayers.plane.begin(), mLayers.plane.end(), -1);
+        std::string key = getGeometryKey();
+        auto cached = mPlaneCache.find(key);
+        if (cached != mPlaneCache.end()) {
+            for (size_t i = 0; i < sorted.size(); i++) {
+                mLayers.plane[sorted[i]] = cached->second[i];
+            }
+            mPlanesTested = true;
+        } else {
+            pickPlanes(sorted);
+            mPlanesTested = searchPlanes(sorted);
+            if (mPlanesTested) {
+                // geometry rarely repeats beyond a handful of states
+                if (mPlaneCache.size() >= 32) {
+                    mPlaneCache.clear();
+                }
+                std::vector<int32_t> planes;
+                for (uint32_t slot : sorted) {
+                    planes.push_back(mLayers.plane[slot]);
+                }
+                mPlaneCache.emplace(std::move(key), std::move(planes));
+            }
+        }
+    }
+
+    mChangedLayers.clear();
+    for (uint32_t slot : sorted) {
+        int32_t type = mLayers.plane[slot] >= 0 ? mLayers.compositionType[slot]
+                                                : HWC2_COMPOSITION_CLIENT;
+        mLayers.validatedType[slot] = type;
+        if (type != mLayers.compositionType[slot]) {
+            mChangedLayers.push_back(mLayers.ids[slot]);
+        }
+    }
 }
 
-void Hwc2Device::clearDirtyLayers() {
-    mDirtyLayers.clear();
+// The client target always sits on the primary plane, so device layers
+// have to be above every client layer: hand overlays to the topmost run
+// of layers that fit one, in stacking order. Only when nothing is left
+// for the client the bottom layer may take the primary plane itself.
+// A cursor layer on top gets the cursor plane first.
+void Hwc2Device::pickPlanes(const std::vector<uint32_t>& sorted) {
+    kms_plane_state state;
+    size_t lowest = sorted.size();
+    int32_t cursorPlane = mHwcContext->cursor_plane();
+    if (lowest > 1 && cursorPlane >= 0 &&
+            getPlaneState(sorted[lowest - 1], cursorPlane, &state)) {
+        mLayers.plane[sorted[lowest - 1]] = cursorPlane;
+        lowest--;
+    }
+    uint32_t nextPlane = mHwcContext->plane_count();
+    while (lowest > 0 && nextPlane > 1) {
+        uint32_t slot = sorted[lowest - 1];
+        uint32_t plane = nextPlane - 1;
+        while (plane >= 1 && !getPlaneState(slot, plane, &state)) {
+            plane--;
+        }
+        if (plane < 1) {
+            break;
+        }
+        mLayers.plane[slot] = plane;
+        nextPlane = plane;
+        lowest--;
+    }
+    if (lowest == 0 && !sorted.empty()) {
+        // no client layer left, but the primary plane must show something
+        mLayers.plane[sorted[0]] = -1;
+        lowest = 1;
+    }
+    if (lowest == 1 && getPlaneState(sorted[0], 0, &state)) {
+        mLayers.plane[sorted[0]] = 0;
+    }
 }
 
 
@@ -330,9 +1002,10 @@ bool Hwc2Device::VsyncThread::sleepUntil(int64_t t) {
     }
 }
 
-void Hwc2Device::VsyncThread::start(int64_t firstVsync, int64_t period) {
+void Hwc2Device::VsyncThread::start(int64_t firstVsync, int64_t period, hwc_context* context) {
     mNextVsync = firstVsync;
     mPeriod = period;
+    mContext = context;
     mStarted = true;
     mThread = std::thread(&VsyncThread::vsyncLoop, this);
 }
@@ -346,12 +1019,20 @@ void Hwc2Device::VsyncThread::stop() {
     mThread.join();
 }
 
-void Hwc2Device::VsyncThread::setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data) {
+void Hwc2Device::VsyncThread::setCallback(HWC2_PFN_VSYNC_2_4 callback,
+        hwc2_callback_data_t data) {
     std::lock_guard<std::mutex> lock(mMutex);
     mCallback = callback;
     mCallbackData = data;
 }
 
+void Hwc2Device::VsyncThread::setPeriodCallback(HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED callback,
+        hwc2_callback_data_t data) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPeriodCallback = callback;
+    mPeriodCallbackData = data;
+}
+
 void Hwc2Device::VsyncThread::enableCallback(bool enable) {
     {
         std::lock_guard<std::mutex> lock(mMutex);
@@ -360,6 +1041,14 @@ void Hwc2Device::VsyncThread::enableCallback(bool enable) {
     mCondition.notify_all();
 }
 
+void Hwc2Device::VsyncThread::setIdle(bool idle) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mIdle = idle;
+    }
+    mCondition.notify_all();
+}
+
 void Hwc2Device::VsyncThread::vsyncLoop() {
     prctl(PR_SET_NAME, "VsyncThread", 0, 0, 0);
 
@@ -369,8 +1058,8 @@ void Hwc2Device::VsyncThread::vsyncLoop() {
     }
 
     while (true) {
-        if (!mCallbackEnabled) {
-            mCondition.wait(lock, [this] { return mCallbackEnabled || !mStarted; });
+        if (!mCallbackEnabled || mIdle) {
+            mCondition.wait(lock, [this] { return (mCallbackEnabled && !mIdle) || !mStarted; });
             if (!mStarted) {
                 break;
             }
@@ -378,25 +1067,112 @@ void Hwc2Device::VsyncThread::vsyncLoop() {
 
         lock.unlock();
 
-        // adjust mNextVsync if necessary
-        int64_t t = now();
-        if (mNextVsync < t) {
-            int64_t n = (t - mNextVsync + mPeriod - 1) / mPeriod;
-            mNextVsync += mPeriod * n;
-        }
-        bool fire = sleepUntil(mNextVsync);
+        bool fire = waitUntilNextVsync();
 
         lock.lock();
 
         if (fire) {
 	    //ALOGV("VsyncThread(%" PRId64 ")", mNextVsync);
+            int64_t period = mContext ? mContext->vsync_period() : mPeriod;
+            if (period != mPeriod) {
+                ALOGI("vsync period %" PRId64 " -> %" PRId64, mPeriod, period);
+                mPeriod = period;
+                if (mPeriodCallback) {
+                    hwc_vsync_period_change_timeline_t timeline = {mNextVsync, false, 0};
+                    mPeriodCallback(mPeriodCallbackData, 0, &timeline);
+                }
+            }
             if (mCallback) {
-                mCallback(mCallbackData, 0, mNextVsync);
+                mCallback(mCallbackData, 0, mNextVsync, mPeriod);
             }
             mNextVsync += mPeriod;
         }
     }
 }
 
-} // namespace aidl::android::hardware::graphics::composer3::impl
+bool Hwc2Device::VsyncThread::waitUntilNextVsync() {
+    int64_t timestamp;
+    int error = mContext ? mContext->wait_vblank(&timestamp) : -ENODEV;
+    if (!error) {
+        if (mHwVsyncFailed) {
+            ALOGI("vblank events are back");
+            mHwVsyncFailed = false;
+        }
+        // keeps the software timer in phase should vblank go away
+        mNextVsync = timestamp;
+        return true;
+    }
+    if (!mHwVsyncFailed) {
+        ALOGW("no vblank events (%s), using a software vsync", strerror(-error));
+        mHwVsyncFailed = true;
+    }
+
+    // adjust mNextVsync if necessary
+    int64_t t = now();
+    if (mNextVsync < t) {
+        int64_t n = (t - mNextVsync + mPeriod - 1) / mPeriod;
+        mNextVsync += mPeriod * n;
+    }
+    return sleepUntil(mNextVsync);
+}
+
+void Hwc2Device::IdleTimer::start(Hwc2Device* device) {
+    mDevice = device;
+    mLastPresent = VsyncThread::now();
+    mThread = std::thread(&IdleTimer::timerLoop, this);
+}
+
+void Hwc2Device::IdleTimer::setTimeout(int64_t timeoutNs) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTimeout = timeoutNs;
+        mLastPresent = VsyncThread::now();
+    }
+    mCondition.notify_all();
+}
+
+bool Hwc2Device::IdleTimer::present() {
+    bool idle;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        idle = std::exchange(mIdle, false);
+        mLastPresent = VsyncThread::now();
+    }
+    if (idle) {
+        mCondition.notify_all();
+    }
+    return idle;
+}
+
+void Hwc2Device::IdleTimer::committed() {
+    // a present since onIdle() already ended the idle period
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mIdle) {
+        mDevice->onIdleCommitted();
+    }
+}
+
+void Hwc2Device::IdleTimer::timerLoop() {
+    prctl(PR_SET_NAME, "IdleTimer", 0, 0, 0);
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        if (!mTimeout || mIdle) {
+            mCondition.wait(lock);
+            continue;
+        }
+        int64_t left = mLastPresent + mTimeout - VsyncThread::now();
+        if (left > 0) {
+            mCondition.wait_for(lock, std::chrono::nanoseconds(left));
+            continue;
+        }
+        if (mDevice->onIdle()) {
+            mIdle = true;
+        } else {
+            // frames still queued, count from now
+            mLastPresent = VsyncThread::now();
+        }
+    }
+}
 
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -24,18 +24,24 @@
 #undef HWC2_USE_CPP11
 #undef HWC2_INCLUDE_STRINGIFICATION
 
+#include <android-base/unique_fd.h>
 #include <ui/Fence.h>
 
 #include <condition_variable>
 #include <mutex>
 #include <string>
 #include <thread>
-#include <unordered_set>
+#include <unordered_map>
+#include <vector>
 
+#include "LayerStore.h"
 #include "hwc_context.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
 
+// composer3's onVsyncIdle has no HWC2 callback
+typedef void (*PFN_VSYNC_IDLE)(hwc2_callback_data_t callbackData, hwc2_display_t display);
+
 class Hwc2Device {
 public:
     Hwc2Device();
@@ -47,11 +53,27 @@ public:
     int32_t getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t config,
             int32_t intAttribute, int32_t* outValue);
     int32_t getDisplayName(hwc2_display_t displayId, uint32_t* outSize, char* outName);
+    int32_t getDisplayConfigs(hwc2_display_t displayId, uint32_t* outNumConfigs,
+            hwc2_config_t* outConfigs);
+    int32_t getActiveConfig(hwc2_display_t displayId, hwc2_config_t* outConfig);
+    int32_t getDisplayVsyncPeriod(hwc2_display_t displayId, hwc2_vsync_period_t* outVsyncPeriod);
+    int32_t setActiveConfigWithConstraints(hwc2_display_t displayId, hwc2_config_t config,
+            hwc_vsync_period_change_constraints_t* constraints,
+            hwc_vsync_period_change_timeline_t* outTimeline);
 
     int32_t setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled);
+    // 0 turns the idle timer off
+    int32_t setIdleTimerEnabled(hwc2_display_t displayId, int32_t timeoutMs);
+    // whether DISPLAY_IDLE_TIMER can be claimed
+    int32_t getIdleTimerSupport(hwc2_display_t displayId, bool* outSupport);
+
+    // the composer's buffer caches took in or freed a buffer, for the fb cache
+    uint64_t getBufferKey(buffer_handle_t buffer);
+    void releaseBuffer(uint64_t key);
+    int32_t setExpectedPresentTime(hwc2_display_t displayId, int64_t time);
 
     int32_t setClientTarget(hwc2_display_t displayId, buffer_handle_t target,
-            int32_t acquireFence, int32_t dataspace);
+            int32_t acquireFence, int32_t dataspace, hwc_region_t damage);
     int32_t validateDisplay(hwc2_display_t displayId, uint32_t* outNumTypes,
             uint32_t* outNumRequests);
     int32_t presentDisplay(hwc2_display_t displayId, int32_t* outRetireFence);
@@ -59,13 +81,33 @@ public:
 
     int32_t getChangedCompositionTypes(hwc2_display_t displayId, uint32_t* outNumElements,
             hwc2_layer_t* outLayers, int32_t* outTypes);
+    int32_t getReleaseFences(hwc2_display_t displayId, uint32_t* outNumElements,
+            hwc2_layer_t* outLayers, int32_t* outFences);
+    int32_t setCursorPosition(hwc2_display_t displayId, hwc2_layer_t layerId, int32_t x,
+            int32_t y);
+    int32_t setLayerBuffer(hwc2_display_t displayId, hwc2_layer_t layerId,
+            buffer_handle_t buffer, int32_t acquireFence);
+    int32_t setLayerBlendMode(hwc2_display_t displayId, hwc2_layer_t layerId, int32_t mode);
     int32_t setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
             int32_t intType);
+    int32_t setLayerDataspace(hwc2_display_t displayId, hwc2_layer_t layerId,
+            int32_t dataspace);
+    int32_t setLayerDisplayFrame(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_rect_t frame);
+    int32_t setLayerPlaneAlpha(hwc2_display_t displayId, hwc2_layer_t layerId, float alpha);
+    int32_t setLayerSurfaceDamage(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_region_t damage);
+    int32_t setLayerSourceCrop(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_frect_t crop);
+    int32_t setLayerTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+            int32_t transform);
+    int32_t setLayerZOrder(hwc2_display_t displayId, hwc2_layer_t layerId, uint32_t z);
 
     void dump(uint32_t* outSize, char* outBuffer);
 
     int32_t registerCallback(int32_t intDesc, hwc2_callback_data_t callbackData,
             hwc2_function_pointer_t pointer);
+    void registerVsyncIdleCallback(hwc2_callback_data_t callbackData, PFN_VSYNC_IDLE callback);
 
 private:
     struct Info {
@@ -79,6 +121,8 @@ private:
     };
     Info mFbInfo{};
     const Info& getInfo() const { return mFbInfo; }
+    // from the active config
+    void updateInfo();
 
     enum class State {
         MODIFIED,
@@ -89,17 +133,35 @@ private:
     void setState(State state) { mState = state; }
     State getState() const { return mState; }
 
-    uint64_t mNextLayerId{0};
-    std::unordered_set<hwc2_layer_t> mLayers;
-    std::unordered_set<hwc2_layer_t> mDirtyLayers;
-    hwc2_layer_t addLayer();
-    bool removeLayer(hwc2_layer_t layer);
-    bool hasLayer(hwc2_layer_t layer) const;
-    bool markLayerDirty(hwc2_layer_t layer, bool dirty);
-    const std::unordered_set<hwc2_layer_t>& getDirtyLayers() const;
-    void clearDirtyLayers();
+    LayerStore mLayers;
+    // layers whose validatedType differs from what the client asked for
+    std::vector<hwc2_layer_t> mChangedLayers;
+    int32_t getLayer(hwc2_display_t displayId, hwc2_layer_t layerId, uint32_t* outSlot);
+
+    bool getPlaneState(uint32_t slot, uint32_t plane, kms_plane_state* outState) const;
+    bool buildFrame(hwc_frame* frame, bool takeFences);
+    std::string getGeometryKey() const;
+    void pickPlanes(const std::vector<uint32_t>& sorted);
+    bool searchPlanes(const std::vector<uint32_t>& sorted);
+    void assignPlanes();
+
+    // the planes of the layers passed a test commit, or came from the cache
+    bool mPlanesTested{false};
+    // plane per layer in z order, for geometry already tested
+    std::unordered_map<std::string, std::vector<int32_t>> mPlaneCache;
 
     buffer_handle_t mBuffer{nullptr};
+    ::android::base::unique_fd mBufferAcquireFence;
+    std::vector<hwc_rect_t> mBufferDamage;
+    // anything but the layers' properties that makes the next frame look
+    // different from the last one, see presentDisplay()
+    bool mFrameChanged{true};
+    // CLOCK_MONOTONIC ns for the next present only, 0 for asap
+    int64_t mExpectedPresentTime{0};
+    // desiredTimeNanos of a config switch, the frame carrying it isn't presented earlier
+    int64_t mConfigPresentTime{0};
+    std::vector<hwc2_layer_t> mReleasedLayers;
+    std::vector<::android::base::unique_fd> mReleaseFences;
 
 
     std::string mDumpString;
@@ -109,10 +171,14 @@ private:
         static int64_t now();
         static bool sleepUntil(int64_t t);
 
-        void start(int64_t first, int64_t period);
+        void start(int64_t first, int64_t period, hwc_context* context);
         void stop();
-        void setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data);
+        void setCallback(HWC2_PFN_VSYNC_2_4 callback, hwc2_callback_data_t data);
+        void setPeriodCallback(HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED callback,
+                hwc2_callback_data_t data);
         void enableCallback(bool enable);
+        // no callbacks while idle, whether enabled or not
+        void setIdle(bool idle);
 
     private:
         void vsyncLoop();
@@ -122,15 +188,66 @@ private:
         int64_t mNextVsync{0};
         int64_t mPeriod{0};
 
+        // vblank source; the software timer only fills in when it fails
+        hwc_context* mContext{nullptr};
+        bool mHwVsyncFailed{false};
+
         std::mutex mMutex;
         std::condition_variable mCondition;
         bool mStarted{false};
-        HWC2_PFN_VSYNC mCallback{nullptr};
+        HWC2_PFN_VSYNC_2_4 mCallback{nullptr};
         hwc2_callback_data_t mCallbackData{nullptr};
+        // the period of the mode on screen changed, reported with the first vblank of it
+        HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED mPeriodCallback{nullptr};
+        hwc2_callback_data_t mPeriodCallbackData{nullptr};
         bool mCallbackEnabled{false};
+        bool mIdle{false};
     };
     VsyncThread mVsyncThread;
 
+    // Calls onIdle() once no frame was presented for the timeout, then
+    // waits for the next present.
+    class IdleTimer {
+    public:
+        void start(Hwc2Device* device);
+        void setTimeout(int64_t timeoutNs);
+        // returns true if the display was idle
+        bool present();
+        // the idle drop is on screen, reported unless a present came first
+        void committed();
+
+    private:
+        void timerLoop();
+
+        std::thread mThread;
+        Hwc2Device* mDevice{nullptr};
+
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        int64_t mTimeout{0};
+        int64_t mLastPresent{0};
+        bool mIdle{false};
+    };
+    IdleTimer mIdleTimer;
+    // on the timer thread, with its lock held so a present waits for it
+    bool onIdle();
+    // on the commit thread, also with the timer's lock held
+    static void idleHook(void* data);
+    void onIdleCommitted();
+    std::mutex mIdleCallbackLock;
+    PFN_VSYNC_IDLE mVsyncIdleCallback{nullptr};
+    hwc2_callback_data_t mVsyncIdleCallbackData{nullptr};
+
+    // on the hotplug thread of hwc_context
+    static void hotplugHook(void* data);
+    void onHotplug();
+    // layers, buffers and configs: every HWC2 call on the display takes it,
+    // and so does the hotplug thread while it resets them
+    std::mutex mDisplayLock;
+    std::mutex mHotplugLock;
+    HWC2_PFN_HOTPLUG mHotplugCallback{nullptr};
+    hwc2_callback_data_t mHotplugCallbackData{nullptr};
+
     std::unique_ptr<hwc_context> mHwcContext;
 };
 
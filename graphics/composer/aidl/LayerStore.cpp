@@ -0,0 +1,215 @@
+/*
+ * Copyright 2020 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "composer-LayerStore"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <algorithm>
+
+#include <drm_handle.h>
+
+#include "LayerStore.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+hwc2_layer_t LayerStore::addLayer() {
+    hwc2_layer_t id = ++mNextId;
+    uint32_t slot = ids.size();
+    mSlots.emplace(id, slot);
+
+    ids.push_back(id);
+    buffer.push_back(nullptr);
+    acquireFence.emplace_back();
+    compositionType.push_back(HWC2_COMPOSITION_INVALID);
+    displayFrame.push_back({});
+    sourceCrop.push_back({});
+    z.push_back(0);
+    planeAlpha.push_back(1.0f);
+    blendMode.push_back(HWC2_BLEND_MODE_NONE);
+    transform.push_back(0);
+    dataspace.push_back(HAL_DATASPACE_UNKNOWN);
+    damage.emplace_back();
+    dirty.push_back(DIRTY_ADDED);
+    geometry.emplace_back();
+    validatedType.push_back(HWC2_COMPOSITION_CLIENT);
+    plane.push_back(-1);
+    onScreen.push_back(false);
+    mDirtyAll |= DIRTY_ADDED;
+    mFrameChanges |= DIRTY_ADDED;
+    return id;
+}
+
+template <typename T>
+static void moveSlot(std::vector<T>& field, uint32_t to) {
+    if (to != field.size() - 1) {
+        field[to] = std::move(field.back());
+    }
+    field.pop_back();
+}
+
+bool LayerStore::removeLayer(hwc2_layer_t id) {
+    auto it = mSlots.find(id);
+    if (it == mSlots.end()) {
+        return false;
+    }
+    uint32_t slot = it->second;
+    mSlots.erase(it);
+    if (slot != ids.size() - 1) {
+        mSlots[ids.back()] = slot;
+    }
+
+    moveSlot(ids, slot);
+    moveSlot(buffer, slot);
+    moveSlot(acquireFence, slot);
+    moveSlot(compositionType, slot);
+    moveSlot(displayFrame, slot);
+    moveSlot(sourceCrop, slot);
+    moveSlot(z, slot);
+    moveSlot(planeAlpha, slot);
+    moveSlot(blendMode, slot);
+    moveSlot(transform, slot);
+    moveSlot(dataspace, slot);
+    moveSlot(damage, slot);
+    moveSlot(dirty, slot);
+    moveSlot(geometry, slot);
+    moveSlot(validatedType, slot);
+    moveSlot(plane, slot);
+    moveSlot(onScreen, slot);
+    // the z order has a hole
+    mDirtyAll |= DIRTY_ADDED;
+    mFrameChanges |= DIRTY_ADDED;
+    return true;
+}
+
+int32_t LayerStore::find(hwc2_layer_t id) const {
+    auto it = mSlots.find(id);
+    return it == mSlots.end() ? -1 : int32_t(it->second);
+}
+
+// Plane assignments only depend on the buffer's layout, so a stream of
+// new buffers doesn't dirty anything.
+bool LayerStore::setBuffer(uint32_t slot, buffer_handle_t newBuffer,
+        ::android::base::unique_fd fence) {
+    buffer_handle_t old = buffer[slot];
+    buffer[slot] = newBuffer;
+    acquireFence[slot] = std::move(fence);
+    if (old == newBuffer) {
+        return false;
+    }
+    mFrameChanges |= DIRTY_BUFFER;
+    if (old && newBuffer && private_handle_t::validate(old) == 0 &&
+            private_handle_t::validate(newBuffer) == 0) {
+        auto a = reinterpret_cast<const private_handle_t*>(old);
+        auto b = reinterpret_cast<const private_handle_t*>(newBuffer);
+        if (a->format == b->format && a->width == b->width && a->height == b->height &&
+                a->stride == b->stride) {
+            return false;
+        }
+    }
+    dirty[slot] |= DIRTY_BUFFER_KIND;
+    mDirtyAll |= DIRTY_BUFFER_KIND;
+    mFrameChanges |= DIRTY_BUFFER_KIND;
+    return true;
+}
+
+void LayerStore::dropBuffers() {
+    for (uint32_t slot = 0; slot < ids.size(); slot++) {
+        buffer[slot] = nullptr;
+        acquireFence[slot].reset();
+        dirty[slot] |= DIRTY_BUFFER_KIND;
+    }
+    mDirtyAll |= DIRTY_BUFFER_KIND;
+    mFrameChanges |= DIRTY_BUFFER_KIND;
+}
+
+void LayerStore::setCursorPosition(uint32_t slot, int32_t x, int32_t y) {
+    hwc_rect_t& frame = displayFrame[slot];
+    frame.right += x - frame.left;
+    frame.bottom += y - frame.top;
+    frame.left = x;
+    frame.top = y;
+    dirty[slot] |= DIRTY_CURSOR_POSITION;
+    mDirtyAll |= DIRTY_CURSOR_POSITION;
+}
+
+// Only a real rect makes a new frame of the same buffer, front buffer
+// rendering does that.
+void LayerStore::setSurfaceDamage(uint32_t slot, const hwc_region_t& region) {
+    damage[slot].assign(region.rects, region.rects + region.numRects);
+    for (const hwc_rect_t& rect : damage[slot]) {
+        if (rect.right > rect.left && rect.bottom > rect.top) {
+            mFrameChanges |= DIRTY_DAMAGE;
+            break;
+        }
+    }
+}
+
+void LayerStore::acceptCompositionType(uint32_t slot) {
+    compositionType[slot] = validatedType[slot];
+    mFrameChanges |= DIRTY_COMPOSITION;
+    updateGeometry(slot);
+}
+
+void LayerStore::updateGeometry(uint32_t slot) {
+    Geometry& g = geometry[slot];
+    memset(&g, 0, sizeof(g));
+    g.id = ids[slot];
+    g.z = z[slot];
+    g.compositionType = compositionType[slot];
+    g.displayFrame = displayFrame[slot];
+    if (compositionType[slot] == HWC2_COMPOSITION_CURSOR) {
+        // moving the pointer is no new geometry
+        g.displayFrame.right -= g.displayFrame.left;
+        g.displayFrame.bottom -= g.displayFrame.top;
+        g.displayFrame.left = 0;
+        g.displayFrame.top = 0;
+    }
+    g.sourceCrop = sourceCrop[slot];
+    g.planeAlpha = planeAlpha[slot];
+    g.blendMode = blendMode[slot];
+    g.transform = transform[slot];
+    g.dataspace = dataspace[slot];
+    if (buffer[slot] && private_handle_t::validate(buffer[slot]) == 0) {
+        auto hnd = reinterpret_cast<const private_handle_t*>(buffer[slot]);
+        g.format = hnd->format;
+        g.width = hnd->width;
+        g.height = hnd->height;
+        g.stride = hnd->stride;
+    }
+}
+
+void LayerStore::refresh() {
+    if (mDirtyAll & (DIRTY_Z | DIRTY_ADDED)) {
+        mSorted.resize(ids.size());
+        for (uint32_t i = 0; i < mSorted.size(); i++) {
+            mSorted[i] = i;
+        }
+        std::stable_sort(mSorted.begin(), mSorted.end(),
+                         [this](uint32_t a, uint32_t b) { return z[a] < z[b]; });
+    }
+    if (mDirtyAll & DIRTY_NEEDS_VALIDATE) {
+        for (uint32_t i = 0; i < ids.size(); i++) {
+            if (dirty[i] & DIRTY_NEEDS_VALIDATE) {
+                updateGeometry(i);
+            }
+        }
+    }
+    std::fill(dirty.begin(), dirty.end(), 0);
+    mDirtyAll = 0;
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2020 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <hardware/hwcomposer2.h>
+#include <system/graphics.h>
+
+#include <android-base/unique_fd.h>
+
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// The layers of a display, one array per property, indexed by a dense
+// slot. Removing a layer moves the last one into its slot, so slots are
+// only good until the next removeLayer(). Setters keep per-layer dirty
+// bits for what changed since validate last looked at the layer.
+class LayerStore {
+public:
+    enum : uint32_t {
+        DIRTY_BUFFER_KIND = 1 << 0,     // a buffer of another format or size
+        DIRTY_COMPOSITION = 1 << 1,
+        DIRTY_DISPLAY_FRAME = 1 << 2,
+        DIRTY_SOURCE_CROP = 1 << 3,
+        DIRTY_Z = 1 << 4,
+        DIRTY_PLANE_ALPHA = 1 << 5,
+        DIRTY_BLEND_MODE = 1 << 6,
+        DIRTY_TRANSFORM = 1 << 7,
+        DIRTY_DATASPACE = 1 << 8,
+        DIRTY_CURSOR_POSITION = 1 << 9, // the pointer moved, nothing to validate
+        DIRTY_ADDED = 1 << 10,
+        DIRTY_BUFFER = 1 << 11,         // any new buffer, only in takeFrameChanges()
+        DIRTY_DAMAGE = 1 << 12,         // drawn into, only in takeFrameChanges()
+    };
+    static constexpr uint32_t DIRTY_NEEDS_VALIDATE =
+            ~(DIRTY_CURSOR_POSITION | DIRTY_BUFFER | DIRTY_DAMAGE);
+
+    // Everything a test commit result depends on, but not the buffers
+    // themselves, so a steady stream of frames keeps hitting the cache.
+    struct Geometry {
+        hwc2_layer_t id;
+        uint32_t z;
+        int32_t compositionType;
+        hwc_rect_t displayFrame;
+        hwc_frect_t sourceCrop;
+        float planeAlpha;
+        int32_t blendMode;
+        int32_t transform;
+        int32_t dataspace;
+        int format;
+        int width;
+        int height;
+        int stride;
+    };
+
+    size_t size() const { return ids.size(); }
+    hwc2_layer_t addLayer();
+    bool removeLayer(hwc2_layer_t id);
+    // slot of a layer, -1 if there is none
+    int32_t find(hwc2_layer_t id) const;
+
+    // Each returns true if the value changed.
+    bool setBuffer(uint32_t slot, buffer_handle_t buffer, ::android::base::unique_fd fence);
+    bool setCompositionType(uint32_t slot, int32_t type) {
+        return update(compositionType, slot, type, DIRTY_COMPOSITION);
+    }
+    bool setDisplayFrame(uint32_t slot, const hwc_rect_t& frame) {
+        return update(displayFrame, slot, frame, DIRTY_DISPLAY_FRAME);
+    }
+    bool setSourceCrop(uint32_t slot, const hwc_frect_t& crop) {
+        return update(sourceCrop, slot, crop, DIRTY_SOURCE_CROP);
+    }
+    bool setZ(uint32_t slot, uint32_t value) { return update(z, slot, value, DIRTY_Z); }
+    bool setPlaneAlpha(uint32_t slot, float alpha) {
+        return update(planeAlpha, slot, alpha, DIRTY_PLANE_ALPHA);
+    }
+    bool setBlendMode(uint32_t slot, int32_t mode) {
+        return update(blendMode, slot, mode, DIRTY_BLEND_MODE);
+    }
+    bool setTransform(uint32_t slot, int32_t value) {
+        return update(transform, slot, value, DIRTY_TRANSFORM);
+    }
+    bool setDataspace(uint32_t slot, int32_t value) {
+        return update(dataspace, slot, value, DIRTY_DATASPACE);
+    }
+    // forgets every buffer, e.g. when the client is about to free them
+    void dropBuffers();
+    // moves the display frame, the size stays
+    void setCursorPosition(uint32_t slot, int32_t x, int32_t y);
+    // kept until the next call, nothing to validate
+    void setSurfaceDamage(uint32_t slot, const hwc_region_t& region);
+    // takes the type validate picked, a change the client agreed to
+    void acceptCompositionType(uint32_t slot);
+
+    // OR of the dirty bits of all layers, plus DIRTY_ADDED after a removal
+    uint32_t dirtyBits() const { return mDirtyAll; }
+    // Brings the z order and the geometry of dirty layers up to date and
+    // clears all dirty bits.
+    void refresh();
+    // slots bottom to top, as of the last refresh()
+    const std::vector<uint32_t>& sorted() const { return mSorted; }
+    // Dirty bits set since the last call, refresh() doesn't clear them.
+    // Zero means the next frame looks like the last one.
+    uint32_t takeFrameChanges() { return std::exchange(mFrameChanges, 0); }
+
+    std::vector<hwc2_layer_t> ids;
+    std::vector<buffer_handle_t> buffer;
+    // only waited on if the layer ends up on a plane
+    std::vector<::android::base::unique_fd> acquireFence;
+    std::vector<int32_t> compositionType;
+    std::vector<hwc_rect_t> displayFrame;
+    std::vector<hwc_frect_t> sourceCrop;
+    std::vector<uint32_t> z;
+    std::vector<float> planeAlpha;
+    std::vector<int32_t> blendMode;
+    std::vector<int32_t> transform;
+    std::vector<int32_t> dataspace;
+    // in buffer pixels: no rects if all of it changed, a single empty one if nothing did
+    std::vector<std::vector<hwc_rect_t>> damage;
+    std::vector<uint32_t> dirty;
+    std::vector<Geometry> geometry;
+
+    // decided by validateDisplay
+    std::vector<int32_t> validatedType;
+    std::vector<int32_t> plane;
+    // the last presented buffer is still scanned out
+    std::vector<uint8_t> onScreen;
+
+private:
+    template <typename T>
+    bool update(std::vector<T>& field, uint32_t slot, const T& value, uint32_t bit) {
+        if (memcmp(&field[slot], &value, sizeof(T)) == 0) {
+            return false;
+        }
+        field[slot] = value;
+        dirty[slot] |= bit;
+        mDirtyAll |= bit;
+        mFrameChanges |= bit;
+        return true;
+    }
+    void updateGeometry(uint32_t slot);
+
+    hwc2_layer_t mNextId{0};
+    std::unordered_map<hwc2_layer_t, uint32_t> mSlots;
+    std::vector<uint32_t> mSorted;
+    uint32_t mDirtyAll{0};
+    uint32_t mFrameChanges{0};
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
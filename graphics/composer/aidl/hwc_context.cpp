@@ -32,29 +32,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <math.h>
 #include <system/graphics.h>
 #include <hardware_legacy/uevent.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sw_sync.h>
+
+#include <algorithm>
+#include <chrono>
 
 #include <drm_fourcc.h>
+#include <drm_gralloc.h>
 
 #include "hwc_context.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
 
-int hwc_context::add_fb(const private_handle_t *hnd)
+int hwc_context::add_fb(const private_handle_t *hnd, struct kms_fb *fb)
 {
-	if (hnd->fb_id)
-		return 0;
-
 	uint32_t pitches[4] = { 0, 0, 0, 0 };
 	uint32_t offsets[4] = { 0, 0, 0, 0 };
 	uint32_t handles[4] = { 0, 0, 0, 0 };
 
-        uint32_t width = (uint32_t)primary_output.mode.hdisplay;
-        uint32_t height = (uint32_t)primary_output.mode.vdisplay;
-        uint32_t drm_format = primary_output.drm_format;
+	uint32_t width = (uint32_t)hnd->width;
+	uint32_t height = (uint32_t)hnd->height;
+	uint32_t drm_format = drm_format_fourcc(hnd->format);
+	if (!drm_format) {
+		ALOGE("add_fb() no drm format for %d", hnd->format);
+		return -EINVAL;
+	}
 
 	uint32_t handle;
 	int ret = drmPrimeFDToHandle(kms_fd, hnd->fd, &handle);
@@ -63,116 +73,1300 @@ int hwc_context::add_fb(const private_handle_t *hnd)
 		return ret;
 	}
 
-	pitches[0] = width * 4;
+	pitches[0] = hnd->pitch;
 	handles[0] = handle;
 
 	ALOGV("add_fb() width:%d height:%d format:%x handle:%d pitch:%d",
 			width, height, drm_format, handle, pitches[0]);
-	return drmModeAddFB2(kms_fd, width, height, drm_format,
-                             handles, pitches, offsets, (uint32_t *)&hnd->fb_id, 0);
+	ret = drmModeAddFB2(kms_fd, width, height, drm_format,
+                             handles, pitches, offsets, &fb->fb_id, 0);
+	if (ret) {
+		drmCloseBufferHandle(kms_fd, handle);
+		return ret;
+	}
+	fb->gem_handle = handle;
+	return 0;
 }
 
+/*
+ * Only fbs that are neither on screen nor committed can go: a frame
+ * stamp older than the frame on screen, or none at all when the buffer
+ * was only imported or tested. RmFB on a scanout fb would turn the
+ * plane off.
+ */
+static bool fb_in_use(const struct kms_fb *fb, uint32_t on_screen)
+{
+	return fb->frame && (int32_t)(fb->frame - on_screen) >= 0;
+}
 
-static int64_t get_property_value(int fd, drmModeObjectPropertiesPtr props,
-				  const char *name) {
-	drmModePropertyPtr prop;
-	uint64_t value;
+void hwc_context::remove_fb_locked(const struct kms_fb *fb)
+{
+	ALOGV("remove fb %u", fb->fb_id);
+	drmModeRmFB(kms_fd, fb->fb_id);
+	drmCloseBufferHandle(kms_fd, fb->gem_handle);
+}
 
-	bool found = false;
-	for (int j = 0; j < props->count_props && !found; j++) {
-		prop = drmModeGetProperty(fd, props->props[j]);
-		if (!strcmp(prop->name, name)) {
-			value = props->prop_values[j];
-			found = true;
+void hwc_context::evict_fbs_locked()
+{
+	uint32_t on_screen = frame_on_screen;
+	while (fb_cache.size() >= FB_CACHE_SIZE) {
+		auto victim = fb_cache.end();
+		for (auto it = fb_cache.begin(); it != fb_cache.end(); ++it) {
+			const struct kms_fb &fb = it->second;
+			if (fb_in_use(&fb, on_screen))
+				continue;
+			if (victim == fb_cache.end() || fb.lru < victim->second.lru)
+				victim = it;
 		}
-		drmModeFreeProperty(prop);
+		if (victim == fb_cache.end()) {
+			ALOGW("fb cache full, %zu fbs in use", fb_cache.size());
+			return;
+		}
+		remove_fb_locked(&victim->second);
+		fb_cache.erase(victim);
 	}
-
-	if (!found)
-		return -1;
-	return value;
 }
 
-static uint32_t get_property_id(int fd, drmModeObjectPropertiesPtr props,
-				   const char *name) {
-	drmModePropertyPtr prop;
-	uint32_t prop_id = 0;
+/*
+ * The fb holds the buffer's GEM handle, which keeps the dma-buf alive
+ * after the client freed it. Unused fbs of freed buffers go right away,
+ * the others with the first post after their frame left the screen.
+ */
+void hwc_context::release_buffer(uint64_t key)
+{
+	std::lock_guard<std::mutex> lock(fb_lock);
+	auto it = fb_cache.find(key);
+	if (it == fb_cache.end())
+		return;
+	if (fb_in_use(&it->second, frame_on_screen)) {
+		it->second.released = true;
+		fbs_released = true;
+		return;
+	}
+	remove_fb_locked(&it->second);
+	fb_cache.erase(it);
+}
 
-	bool found = false;
-	for (int j = 0; j < props->count_props && !found; j++) {
-		prop = drmModeGetProperty(fd, props->props[j]);
-		if (!strcmp(prop->name, name)) {
-		    prop_id = prop->prop_id;
-			found = true;
+void hwc_context::release_fbs_locked()
+{
+	if (!fbs_released)
+		return;
+	uint32_t on_screen = frame_on_screen;
+	fbs_released = false;
+	for (auto it = fb_cache.begin(); it != fb_cache.end();) {
+		if (!it->second.released) {
+			++it;
+		} else if (fb_in_use(&it->second, on_screen)) {
+			fbs_released = true;
+			++it;
+		} else {
+			remove_fb_locked(&it->second);
+			it = fb_cache.erase(it);
 		}
-		drmModeFreeProperty(prop);
 	}
-	return prop_id;
 }
 
+uint64_t hwc_context::buffer_key(buffer_handle_t buffer)
+{
+	const private_handle_t *hnd = (const private_handle_t *)buffer;
+	struct stat st;
+	if (!hnd || private_handle_t::validate(hnd) < 0 || fstat(hnd->fd, &st) < 0)
+		return 0;
+	return (uint64_t)st.st_ino;
+}
+
+/*
+ * The cache is keyed by the dma-buf inode, which stays unique while our
+ * fb holds a reference to the buffer; the buffer_handle_t a client sends
+ * is a fresh clone every time.
+ */
+int hwc_context::get_fb_locked(const private_handle_t *hnd, uint32_t frame,
+		uint32_t *fb_id)
+{
+	struct stat st;
+	if (fstat(hnd->fd, &st) < 0)
+		return -errno;
+
+	auto it = fb_cache.find((uint64_t)st.st_ino);
+	if (it == fb_cache.end()) {
+		evict_fbs_locked();
+		struct kms_fb fb = {};
+		int err = add_fb(hnd, &fb);
+		if (err)
+			return err;
+		it = fb_cache.emplace((uint64_t)st.st_ino, fb).first;
+	}
+	it->second.lru = ++fb_lru;
+	/* the same dma-buf came back, e.g. in another slot */
+	it->second.released = false;
+	if (frame)
+		it->second.frame = frame;
+	*fb_id = it->second.fb_id;
+	return 0;
+}
+
+int hwc_context::import_buffer(buffer_handle_t buffer)
+{
+	const private_handle_t *hnd = (const private_handle_t *)buffer;
+	if (!hnd || private_handle_t::validate(hnd) < 0)
+		return -EINVAL;
+
+	std::lock_guard<std::mutex> lock(fb_lock);
+	uint32_t fb_id;
+	int err = get_fb_locked(hnd, 0, &fb_id);
+	if (err)
+		ALOGE("import_buffer() %p: %s", hnd, strerror(-err));
+	return err;
+}
 
-int hwc_context::atomic_commit(struct kms_output *output, const private_handle_t *hnd, int32_t *out_fence)
+/* from the pixel clock, vrefresh is rounded */
+static int64_t mode_period_ns(const drmModeModeInfo *mode)
 {
-	if (!hnd)
+	if (mode->clock && mode->htotal && mode->vtotal)
+		return (int64_t)mode->htotal * mode->vtotal * 1000000LL / mode->clock;
+	if (mode->vrefresh)
+		return 1000000000LL / mode->vrefresh;
+	return 1000000000LL / 60;
+}
+
+static void add_plane_state(drmModeAtomicReq *req, const struct kms_plane *plane,
+		const struct kms_plane_state *state, uint32_t crtc_id, uint64_t zpos)
+{
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_fb_id, state->fb_id);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_crtc_id, crtc_id);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_src_x, state->src_x);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_src_y, state->src_y);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_src_w, state->src_w);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_src_h, state->src_h);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_crtc_x, (uint64_t)(int64_t)state->crtc_x);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_crtc_y, (uint64_t)(int64_t)state->crtc_y);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_crtc_w, state->crtc_w);
+	drmModeAtomicAddProperty(req, plane->id, plane->prop_crtc_h, state->crtc_h);
+	if (state->acquire_fence >= 0 && plane->prop_in_fence)
+		drmModeAtomicAddProperty(req, plane->id, plane->prop_in_fence,
+				state->acquire_fence);
+	if (plane->prop_zpos && plane->zpos_mutable)
+		drmModeAtomicAddProperty(req, plane->id, plane->prop_zpos,
+				std::clamp(zpos, plane->zpos_min, plane->zpos_max));
+	if (plane->prop_alpha)
+		drmModeAtomicAddProperty(req, plane->id, plane->prop_alpha, state->alpha);
+	if (plane->prop_blend_mode && (plane->blend_modes & (1 << state->blend)))
+		drmModeAtomicAddProperty(req, plane->id, plane->prop_blend_mode,
+				plane->blend_values[state->blend]);
+}
+
+/*
+ * Commits are incremental, a plane left out would keep its old buffer:
+ * planes the frame doesn't use are turned off, all of them or just those
+ * still enabled.
+ */
+static void add_frame(drmModeAtomicReq *req, const struct kms_output *output,
+		const struct hwc_frame *frame, std::vector<bool> *used, bool disable_all)
+{
+	used->assign(output->planes.size(), false);
+	for (size_t i = 0; i < frame->planes.size(); i++) {
+		const struct kms_plane_state *state = &frame->planes[i];
+		add_plane_state(req, &output->planes[state->plane], state, output->crtc_id, i);
+		(*used)[state->plane] = true;
+	}
+	for (size_t i = 0; i < output->planes.size(); i++) {
+		const struct kms_plane *plane = &output->planes[i];
+		if ((*used)[i] || (!disable_all && !plane->enabled))
+			continue;
+		drmModeAtomicAddProperty(req, plane->id, plane->prop_fb_id, 0);
+		drmModeAtomicAddProperty(req, plane->id, plane->prop_crtc_id, 0);
+	}
+}
+
+int hwc_context::test_frame(const struct hwc_frame *frame)
+{
+	/* planes on a crtc that isn't running yet fail any test */
+	if (first_post)
+		return -EAGAIN;
+	if (frame->planes.empty())
+		return -EINVAL;
+
+	struct hwc_frame scaled = *frame;
+	/* held through the commit so the fbs can't be evicted under the test */
+	std::lock_guard<std::mutex> lock(fb_lock);
+	for (auto &state : scaled.planes) {
+		if (state.plane >= primary_output.planes.size())
+			return -EINVAL;
+		int err = get_fb_locked(state.hnd, 0, &state.fb_id);
+		if (err)
+			return err;
+		scale_to_mode(&state);
+	}
+
+	int ret = test_commit(&scaled);
+	ALOGV("test_frame() %zu planes: %d", frame->planes.size(), ret);
+	return ret;
+}
+
+/* TEST_ONLY commit of a frame with fbs, already scaled to the mode */
+int hwc_context::test_commit(const struct hwc_frame *frame)
+{
+	/* plane enabled flags belong to the commit thread, turn off everything else */
+	std::vector<bool> used;
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	add_frame(req, &primary_output, frame, &used, true);
+
+	/* the next frame carries the mode of a config switch, test the planes with it */
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	uint32_t mode_blob = 0;
+	drmModeModeInfo crtc_mode = get_crtc_mode();
+	if (memcmp(&primary_output.mode, &crtc_mode, sizeof(crtc_mode)) &&
+			primary_output.prop_mode_id &&
+			!drmModeCreatePropertyBlob(kms_fd, &primary_output.mode,
+				sizeof(primary_output.mode), &mode_blob)) {
+		drmModeAtomicAddProperty(req, primary_output.crtc_id, primary_output.prop_mode_id,
+				mode_blob);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+	int ret = drmModeAtomicCommit(kms_fd, req, flags, NULL);
+	if (ret < 0)
+		ret = -errno;
+	drmModeAtomicFree(req);
+	if (mode_blob)
+		drmModeDestroyPropertyBlob(kms_fd, mode_blob);
+	return ret;
+}
+
+/*
+ * Any other size goes through the primary plane's scaler, the same way
+ * as a layer. The driver is asked once per size, with a dumb buffer
+ * standing in for the client's.
+ */
+bool hwc_context::client_target_check(uint32_t w, uint32_t h)
+{
+	if (w == width && h == height)
+		return true;
+	/* nothing to test against before the crtc runs */
+	if (first_post || !w || !h || primary_output.planes.empty())
+		return false;
+
+	std::lock_guard<std::mutex> lock(fb_lock);
+	uint64_t key = (uint64_t)w << 32 | h;
+	auto cached = client_target_sizes.find(key);
+	if (cached != client_target_sizes.end())
+		return cached->second;
+
+	uint32_t fourcc = drm_format_fourcc(format);
+	struct drm_mode_create_dumb create = {};
+	create.width = w;
+	create.height = h;
+	create.bpp = drm_format_bpp(format) * 8;
+	if (!fourcc || drmIoctl(kms_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+		return false;
+
+	uint32_t handles[4] = { create.handle, 0, 0, 0 };
+	uint32_t pitches[4] = { create.pitch, 0, 0, 0 };
+	uint32_t offsets[4] = { 0, 0, 0, 0 };
+	struct kms_plane_state state = {};
+	bool ok = false;
+	if (!drmModeAddFB2(kms_fd, w, h, fourcc, handles, pitches, offsets, &state.fb_id, 0)) {
+		struct hwc_frame frame;
+		state.plane = 0;
+		state.acquire_fence = -1;
+		state.crtc_w = width;
+		state.crtc_h = height;
+		state.src_w = w << 16;
+		state.src_h = h << 16;
+		state.alpha = 0xffff;
+		state.blend = KMS_BLEND_NONE;
+		scale_to_mode(&state);
+		frame.planes.push_back(state);
+		ok = test_commit(&frame) == 0;
+		drmModeRmFB(kms_fd, state.fb_id);
+	}
+	struct drm_mode_destroy_dumb destroy = {};
+	destroy.handle = create.handle;
+	drmIoctl(kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+
+	ALOGI("client target %ux%u %s", w, h, ok ? "scaled by the primary plane" :
+			"can't be scaled");
+	client_target_sizes[key] = ok;
+	return ok;
+}
+
+int hwc_context::atomic_commit(struct kms_output *output, struct hwc_frame *frame,
+		int32_t *out_fence, uint32_t present_seq, bool mode_change)
+{
+	if (frame->planes.empty())
 		return 0;
 
+	/* without IN_FENCE_FD the rendering has to finish before we commit */
+	for (const auto &state : frame->planes) {
+		if (state.acquire_fence >= 0 && !output->planes[state.plane].prop_in_fence)
+			drm_wait_fence(state.acquire_fence, "hwc commit");
+	}
+
+	if (!wait_flip_done())
+		ALOGW("previous flip on crtc %d did not complete", output->crtc_id);
+
 	int ret = 0;
 	drmModeAtomicReq *req = drmModeAtomicAlloc();
-	drmModeAtomicAddProperty(req, output->crtc_id, output->prop_out_fence, uint64_t(out_fence));
-    drmModeAtomicAddProperty(req, output->plane_id, output->prop_fb_id, hnd->fb_id);
-    drmModeAtomicAddProperty(req, output->plane_id, output->prop_crtc_id, output->crtc_id);
+	if (out_fence)
+		drmModeAtomicAddProperty(req, output->crtc_id, output->prop_out_fence,
+				uint64_t(out_fence));
+
+	/*
+	 * A new config rides on the frame, the flip event completes it. A
+	 * modeset also routes the connector and turns the crtc on.
+	 */
+	bool modeset = first_post;
+	uint32_t mode_blob = 0;
+	if (mode_change || modeset) {
+		if (!output->prop_mode_id || drmModeCreatePropertyBlob(kms_fd, &frame->mode,
+				sizeof(frame->mode), &mode_blob)) {
+			drmModeAtomicFree(req);
+			return -ENOTSUP;
+		}
+		drmModeAtomicAddProperty(req, output->crtc_id, output->prop_mode_id, mode_blob);
+	}
+	if (modeset) {
+		if (!output->prop_active || !output->prop_conn_crtc_id) {
+			drmModeAtomicFree(req);
+			drmModeDestroyPropertyBlob(kms_fd, mode_blob);
+			return -ENOTSUP;
+		}
+		drmModeAtomicAddProperty(req, output->crtc_id, output->prop_active, 1);
+		drmModeAtomicAddProperty(req, output->connector_id, output->prop_conn_crtc_id,
+				output->crtc_id);
+	}
+
+	/* the cursor may have moved since the frame was queued */
+	std::lock_guard<std::mutex> cursor_guard(cursor_lock);
+	for (auto &state : frame->planes) {
+		if ((int32_t)state.plane == output->cursor_plane) {
+			state.crtc_x = cursor_x;
+			state.crtc_y = cursor_y;
+		}
+	}
+
+	std::vector<bool> used;
+	add_frame(req, output, frame, &used, modeset);
+
+	/* no blob is full damage; the plane state holds its own reference */
+	std::vector<uint32_t> damage_blobs;
+	for (const auto &state : frame->planes) {
+		const struct kms_plane *plane = &output->planes[state.plane];
+		if (!plane->prop_damage_clips)
+			continue;
+		uint32_t blob_id = 0;
+		if (!state.damage.empty() && damage_valid(&state) &&
+				!drmModeCreatePropertyBlob(kms_fd, state.damage.data(),
+					state.damage.size() * sizeof(state.damage[0]), &blob_id))
+			damage_blobs.push_back(blob_id);
+		drmModeAtomicAddProperty(req, plane->id, plane->prop_damage_clips, blob_id);
+	}
 
-	uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK;
-	ret = drmModeAtomicCommit(kms_fd, req, flags, (void *)this);
+	/* an idle drop and the way back only change the rate, they must not blank */
+	bool seamless = !modeset && (frame->idle || (crtc_idle &&
+			!memcmp(&frame->mode, &idle_from, sizeof(frame->mode))));
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	if (!seamless)
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	{
+		/* under flip_lock so the event can't beat flip_pending */
+		std::lock_guard<std::mutex> lock(flip_lock);
+		ret = drmModeAtomicCommit(kms_fd, req, flags, (void *)this);
+		if (!ret) {
+			flip_pending = true;
+			pending_frame = frame->stamp;
+			pending_present_seq = present_seq;
+			if ((mode_change || modeset) && !frame->idle)
+				pending_mode_period = mode_period_ns(&frame->mode);
+		}
+	}
 	if (ret < 0)  {
-		ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d))",
-			strerror(errno), output->crtc_id, hnd->fb_id);
+		ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d, %zu planes))",
+			strerror(errno), output->crtc_id, frame->planes[0].fb_id, frame->planes.size());
 		/* try to set mode for next frame */
 		if (errno != EBUSY)
 			first_post = 1;
-    }
+		/* the client's next damage is relative to this lost frame */
+		screen_planes.clear();
+	} else {
+		for (size_t i = 0; i < output->planes.size(); i++)
+			output->planes[i].enabled = used[i];
+		cursor_enabled = output->cursor_plane >= 0 && used[output->cursor_plane];
+		set_screen_planes(frame);
+		if (mode_change || modeset) {
+			ALOGI("mode %s@%d set%s", frame->mode.name, frame->mode.vrefresh,
+					modeset ? " with a modeset" : "");
+			if (frame->idle && !crtc_idle)
+				idle_from = output->crtc_mode;
+			crtc_idle = frame->idle;
+			std::lock_guard<std::mutex> lock(flip_lock);
+			output->crtc_mode = frame->mode;
+		}
+		if (modeset) {
+			first_post = 0;
+			probe_dirty_fb(frame->planes[0].fb_id);
+		}
+	}
 
 	drmModeAtomicFree(req);
+	for (uint32_t blob_id : damage_blobs)
+		drmModeDestroyPropertyBlob(kms_fd, blob_id);
+	if (mode_blob)
+		drmModeDestroyPropertyBlob(kms_fd, mode_blob);
 	return ret < 0 ? ret : 0; 
 }
 
-int hwc_context::hwc_post(buffer_handle_t buffer, int32_t *out_fence)
+void hwc_context::set_screen_planes(const struct hwc_frame *frame)
 {
-    if (private_handle_t::validate(buffer) < 0)
-       return -EINVAL;
+	screen_planes = frame->planes;
+	screen_stamp = frame->stamp;
+	for (auto &state : screen_planes) {
+		state.acquire_fence = -1;
+		state.damage.clear();
+	}
+}
 
-    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(buffer);
+bool hwc_context::damage_valid(const struct kms_plane_state *state)
+{
+	for (const auto &shown : screen_planes) {
+		if (shown.plane == state->plane)
+			return shown.source == state->source;
+	}
+	return false;
+}
 
-	if (!hnd->fb_id) {
-		int err = add_fb(hnd);
-		if (err) {
-			ALOGE("%s: could not create drm fb, (%s)",
-				__func__, strerror(-err));
-			ALOGE("unable to post %p without fb", hnd);
-			return err;
+bool hwc_context::same_planes(const struct hwc_frame *frame)
+{
+	if (frame->planes.size() != screen_planes.size())
+		return false;
+	for (size_t i = 0; i < frame->planes.size(); i++) {
+		const struct kms_plane_state *a = &frame->planes[i];
+		const struct kms_plane_state *b = &screen_planes[i];
+		if (a->plane != b->plane || a->fb_id != b->fb_id || a->source != b->source ||
+				a->crtc_x != b->crtc_x || a->crtc_y != b->crtc_y ||
+				a->crtc_w != b->crtc_w || a->crtc_h != b->crtc_h ||
+				a->src_x != b->src_x || a->src_y != b->src_y ||
+				a->src_w != b->src_w || a->src_h != b->src_h ||
+				a->alpha != b->alpha || a->blend != b->blend)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * The buffers on screen were drawn into again, e.g. front buffer
+ * rendering: manual-update drivers only need to upload the damage.
+ * DirtyFB blocks until it is sent, so there is no flip to wait for.
+ */
+int hwc_context::flush_damage(struct kms_output *output, struct hwc_frame *frame)
+{
+	for (const auto &state : frame->planes)
+		drm_wait_fence(state.acquire_fence, "hwc dirtyfb");
+	if (!wait_flip_done())
+		ALOGW("previous flip on crtc %d did not complete", output->crtc_id);
+
+	std::vector<drmModeClip> clips;
+	for (const auto &state : frame->planes) {
+		clips.clear();
+		for (const auto &rect : state.damage) {
+			if (rect.x2 <= rect.x1 || rect.y2 <= rect.y1)
+				continue;
+			drmModeClip clip;
+			clip.x1 = (unsigned short)std::clamp(rect.x1, 0, 0xffff);
+			clip.y1 = (unsigned short)std::clamp(rect.y1, 0, 0xffff);
+			clip.x2 = (unsigned short)std::clamp(rect.x2, 0, 0xffff);
+			clip.y2 = (unsigned short)std::clamp(rect.y2, 0, 0xffff);
+			clips.push_back(clip);
+		}
+		/* only empty rects: that plane didn't change */
+		if (clips.empty() && !state.damage.empty())
+			continue;
+		if (drmModeDirtyFB(kms_fd, state.fb_id, clips.empty() ? NULL : clips.data(),
+				clips.size()))
+			return -errno;
+	}
+	ALOGV("flush_damage() %zu planes", frame->planes.size());
+	return 0;
+}
+
+void hwc_context::page_flip_handler(int /*fd*/, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+		void *user_data)
+{
+	hwc_context *ctx = (hwc_context *)user_data;
+	ctx->flip_complete(crtc_id, sequence,
+			(int64_t)tv_sec * 1000000000LL + (int64_t)tv_usec * 1000LL);
+}
+
+void hwc_context::flip_complete(uint32_t crtc_id, uint32_t sequence, int64_t timestamp)
+{
+	std::lock_guard<std::mutex> lock(flip_lock);
+	ALOGV("flip_complete() crtc %u seq %u frame %u", crtc_id, sequence, pending_frame);
+	/* the fbs of older frames can be removed from here on */
+	frame_on_screen = pending_frame;
+	flip_sequence = sequence;
+	flip_timestamp = timestamp;
+	flip_pending = false;
+	signal_present_locked(pending_present_seq);
+	pending_present_seq = 0;
+	if (pending_mode_period) {
+		mode_period = pending_mode_period;
+		pending_mode_period = 0;
+	}
+	flip_cond.notify_all();
+}
+
+void hwc_context::signal_present_locked(uint32_t seq)
+{
+	/* the timeline is monotonic: frames replaced in the slot signal too */
+	if (present_timeline < 0 || (int32_t)(seq - present_signaled) <= 0)
+		return;
+	sw_sync_timeline_inc(present_timeline, seq - present_signaled);
+	present_signaled = seq;
+}
+
+bool hwc_context::wait_flip_done()
+{
+	/* a few frames at the slowest refresh we drive */
+	const auto timeout = std::chrono::milliseconds(100);
+
+	std::unique_lock<std::mutex> lock(flip_lock);
+	if (flip_cond.wait_for(lock, timeout, [this] { return !flip_pending; }))
+		return true;
+
+	/* lost event, e.g. the CRTC went off: don't wedge every later commit */
+	flip_pending = false;
+	signal_present_locked(pending_present_seq);
+	pending_present_seq = 0;
+	return false;
+}
+
+drmModeModeInfo hwc_context::get_crtc_mode()
+{
+	std::lock_guard<std::mutex> lock(flip_lock);
+	return primary_output.crtc_mode;
+}
+
+int64_t hwc_context::last_present_time()
+{
+	std::lock_guard<std::mutex> lock(flip_lock);
+	return flip_timestamp;
+}
+
+void hwc_context::event_loop()
+{
+	prctl(PR_SET_NAME, "hwc_drm_event", 0, 0, 0);
+
+	drmEventContext evctx;
+	memset(&evctx, 0, sizeof(evctx));
+	evctx.version = 3;
+	evctx.page_flip_handler2 = page_flip_handler;
+	evctx.vblank_handler = vblank_handler;
+
+	struct pollfd pfd = { kms_fd, POLLIN, 0 };
+	while (true) {
+		int ret = poll(&pfd, 1, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("event_loop() poll failed (%s)", strerror(errno));
+			break;
+		}
+		if (pfd.revents & (POLLERR | POLLHUP)) {
+			ALOGE("event_loop() kms fd error");
+			break;
+		}
+		if (pfd.revents & POLLIN)
+			drmHandleEvent(kms_fd, &evctx);
+	}
+}
+
+/* the kernel doesn't say which connector changed, only that one did */
+static bool is_drm_hotplug(const char *msg, int len)
+{
+	bool drm = false, hotplug = false;
+	for (const char *s = msg; s < msg + len; s += strlen(s) + 1) {
+		if (!strcmp(s, "SUBSYSTEM=drm"))
+			drm = true;
+		else if (!strcmp(s, "HOTPLUG=1"))
+			hotplug = true;
+	}
+	return drm && hotplug;
+}
+
+void hwc_context::hotplug_loop()
+{
+	prctl(PR_SET_NAME, "hwc_hotplug", 0, 0, 0);
+
+	if (!uevent_init()) {
+		ALOGE("hotplug_loop() no uevent socket, hotplug is ignored");
+		return;
+	}
+
+	char msg[2048 + 2];
+	while (true) {
+		int len = uevent_next_event(msg, sizeof(msg) - 2);
+		if (len <= 0)
+			continue;
+		msg[len] = msg[len + 1] = '\0';
+		if (is_drm_hotplug(msg, len))
+			probe_connectors();
+	}
+}
+
+/*
+ * Display 0 can't go away, SF has nothing to fall back to: unplugging
+ * is only logged, and plugging in again or a new mode list reports it
+ * connected once more so SF reads its configs.
+ */
+void hwc_context::probe_connectors()
+{
+	if (kms.snapshot(kms_fd))
+		return;
+
+	const struct kms_connector_info *connector = kms.connector(primary_output.connector_id);
+	if (!connector) {
+		ALOGW("connector %u is gone", primary_output.connector_id);
+		return;
+	}
+	if (connector->connection != DRM_MODE_CONNECTED) {
+		if (primary_connected)
+			ALOGI("connector %u disconnected", connector->id);
+		primary_connected = false;
+		return;
+	}
+
+	bool same_modes = connector->modes.size() == primary_modes.size() &&
+			!memcmp(connector->modes.data(), primary_modes.data(),
+					primary_modes.size() * sizeof(drmModeModeInfo));
+	if (primary_connected && same_modes)
+		return;
+	ALOGI("connector %u connected, %zu modes", connector->id, connector->modes.size());
+	primary_connected = true;
+	primary_modes = connector->modes;
+
+	hotplug_callback_t callback;
+	void *data;
+	{
+		std::lock_guard<std::mutex> lock(hotplug_lock);
+		hotplug_connector = *connector;
+		hotplug_pending = true;
+		callback = hotplug_callback;
+		data = hotplug_data;
+	}
+	if (callback)
+		callback(data);
+}
+
+void hwc_context::set_hotplug_callback(hotplug_callback_t callback, void *data)
+{
+	std::lock_guard<std::mutex> lock(hotplug_lock);
+	hotplug_callback = callback;
+	hotplug_data = data;
+}
+
+bool hwc_context::apply_hotplug()
+{
+	struct kms_connector_info connector;
+	{
+		std::lock_guard<std::mutex> lock(hotplug_lock);
+		if (!hotplug_pending)
+			return false;
+		connector = std::move(hotplug_connector);
+		hotplug_pending = false;
+	}
+
+	if (init_modes(&primary_output, &connector))
+		return false;
+	set_config(primary_output.mode_index);
+	/* another sink, or the same one back: the link wants a full modeset */
+	first_post = 1;
+	return true;
+}
+
+void hwc_context::scale_to_mode(struct kms_plane_state *state)
+{
+	int64_t mode_w = primary_output.mode.hdisplay;
+	int64_t mode_h = primary_output.mode.vdisplay;
+	if (width == mode_w && height == mode_h)
+		return;
+
+	int64_t x0 = (int64_t)state->crtc_x * mode_w / width;
+	int64_t y0 = (int64_t)state->crtc_y * mode_h / height;
+	int64_t x1 = ((int64_t)state->crtc_x + state->crtc_w) * mode_w / width;
+	int64_t y1 = ((int64_t)state->crtc_y + state->crtc_h) * mode_h / height;
+	state->crtc_x = (int32_t)x0;
+	state->crtc_y = (int32_t)y0;
+	state->crtc_w = (uint32_t)(x1 - x0);
+	state->crtc_h = (uint32_t)(y1 - y0);
+}
+
+/* the screen never showed a replaced frame, so its damage adds up */
+static void merge_damage(struct hwc_frame *frame, const struct hwc_frame *replaced)
+{
+	/* a repeat changes nothing */
+	if (replaced->planes.empty())
+		return;
+	for (auto &state : frame->planes) {
+		if (state.damage.empty())
+			continue;
+		auto old = std::find_if(replaced->planes.begin(), replaced->planes.end(),
+				[&state](const kms_plane_state &s) {
+			return s.plane == state.plane && s.source == state.source;
+		});
+		if (old == replaced->planes.end() || old->damage.empty())
+			state.damage.clear();
+		else
+			state.damage.insert(state.damage.end(), old->damage.begin(),
+					old->damage.end());
+	}
+}
+
+static void close_fences(struct hwc_frame *frame)
+{
+	for (auto &state : frame->planes) {
+		if (state.acquire_fence >= 0)
+			close(state.acquire_fence);
+		state.acquire_fence = -1;
+	}
+}
+
+void hwc_context::drop_frames()
+{
+	uint32_t last = 0;
+	{
+		std::lock_guard<std::mutex> lock(commit_lock);
+		for (auto &queued : commit_queue) {
+			close_fences(&queued.frame);
+			/* idle drops have none */
+			if (queued.seq)
+				last = queued.seq;
 		}
+		commit_queue.clear();
 	}
+	std::lock_guard<std::mutex> lock(flip_lock);
+	signal_present_locked(last);
+}
 
+/*
+ * Only drivers that upload or flush by hand implement DirtyFB, the others
+ * fail it with ENOSYS. The full flush doesn't hurt right after a modeset.
+ */
+void hwc_context::probe_dirty_fb(uint32_t fb_id)
+{
+	primary_output.dirty_fb = !drmModeDirtyFB(kms_fd, fb_id, NULL, 0);
+	ALOGI("%s", primary_output.dirty_fb ? "manual update, flushing damage with DirtyFB" :
+			"continuous scanout");
+}
+
+int hwc_context::post_frame(struct hwc_frame *frame, int32_t *out_fence,
+		uint32_t present_seq)
+{
+	const struct kms_plane_state *primary = &frame->planes[0];
 	int ret;
-	if (first_post) {
-		ret = drmModeSetCrtc(kms_fd, primary_output.crtc_id, hnd->fb_id,
-			0, 0, &primary_output.connector_id, 1, &primary_output.mode);
+	if (!first_post && primary_output.dirty_fb && same_planes(frame) &&
+			!memcmp(&frame->mode, &primary_output.crtc_mode, sizeof(frame->mode))) {
+		ret = flush_damage(&primary_output, frame);
 		if (!ret) {
-			first_post = 0;
+			frame_on_screen = frame->stamp;
+			return 0;
+		}
+		ALOGW("DirtyFB failed (%s), committing", strerror(-ret));
+	}
+
+	bool modeset = first_post;
+	bool mode_change = memcmp(&frame->mode, &primary_output.crtc_mode,
+			sizeof(frame->mode)) != 0;
+	ret = atomic_commit(&primary_output, frame, out_fence, present_seq, mode_change);
+	if (ret && modeset)
+		ALOGE("failed modeset (%s) (crtc_id %d, conn %d, mode %dx%d)", strerror(-ret),
+			primary_output.crtc_id, primary_output.connector_id,
+			frame->mode.hdisplay, frame->mode.vdisplay);
+	ALOGV("post_frame() fb_id %d, %zu planes, present %u",
+		primary->fb_id, frame->planes.size(), present_seq);
+
+    return ret;
+}
+
+void hwc_context::commit_loop()
+{
+	prctl(PR_SET_NAME, "hwc_commit", 0, 0, 0);
+
+	/* same as SF main thread, RESET_ON_FORK in main() kept us from inheriting it */
+	struct sched_param param = {0};
+	param.sched_priority = 2;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+		ALOGW("commit_loop() couldn't set SCHED_FIFO (%s)", strerror(errno));
+
+	struct hwc_frame frame;
+	std::vector<drmModeModeInfo> candidates;
+	while (true) {
+		uint32_t seq;
+		{
+			std::unique_lock<std::mutex> lock(commit_lock);
+			commit_cond.wait(lock, [this] { return !commit_queue.empty(); });
+			std::swap(frame, commit_queue.front().frame);
+			seq = commit_queue.front().seq;
+			commit_queue.pop_front();
+			if (frame.idle)
+				candidates = idle_modes;
+		}
+
+		/* no slower mode the crtc can switch to seamlessly: the rate stays */
+		if (frame.idle && !pick_idle_mode(candidates, &frame.mode))
+			continue;
+
+		bool mode_change = memcmp(&frame.mode, &primary_output.crtc_mode,
+				sizeof(frame.mode)) != 0;
+		/* already at the lowest rate */
+		if (frame.idle && !mode_change)
+			continue;
+		if (frame.planes.empty() && (!mode_change || first_post || screen_planes.empty())) {
+			repeat_frame(seq, frame.present_time);
+			continue;
+		}
+
+		if (frame.present_time)
+			wait_present_time(frame.present_time);
+		int ret = frame.planes.empty() ? refresh_mode(&frame, seq) :
+				post_frame(&frame, NULL, seq);
+		close_fences(&frame);
+
+		if (frame.idle && !ret) {
+			/* not under commit_lock, the callback may wait for hwc_idle() */
+			idle_callback_t callback;
+			void *data;
+			{
+				std::lock_guard<std::mutex> lock(commit_lock);
+				callback = idle_callback;
+				data = idle_data;
+			}
+			if (callback)
+				callback(data);
+		}
+
+		std::lock_guard<std::mutex> lock(flip_lock);
+		/* no flip event will signal this frame */
+		if (ret || pending_present_seq != seq)
+			signal_present_locked(seq);
+	}
+}
+
+/*
+ * SF sends a present time with every frame, so latest-wins rarely
+ * applies. A commit thread that falls behind drops the oldest frame
+ * instead: its fences close, its damage goes to the next frame and its
+ * present fence signals with it.
+ */
+void hwc_context::queue_frame_locked(struct queued_frame &&queued)
+{
+	if (commit_queue.size() >= COMMIT_QUEUE_MAX) {
+		struct queued_frame *oldest = &commit_queue[0];
+		struct hwc_frame *next = &commit_queue[1].frame;
+		ALOGW("commit queue full, dropping frame %u", oldest->seq);
+		if (next->planes.empty() && !oldest->frame.planes.empty()) {
+			/* a repeat of the dropped frame shows it instead, as it was built */
+			next->planes = std::move(oldest->frame.planes);
+			next->mode = oldest->frame.mode;
+			next->stamp = oldest->frame.stamp;
+			next->idle = false;
 		} else {
-			ALOGE("failed to set crtc (%s) (crtc_id %d, fb_id %d, conn %d, mode %dx%d)",
-			strerror(errno), primary_output.crtc_id, hnd->fb_id, primary_output.connector_id,
-			primary_output.mode.hdisplay, primary_output.mode.vdisplay);
+			merge_damage(next, &oldest->frame);
+			close_fences(&oldest->frame);
+		}
+		commit_queue.pop_front();
+	}
+	commit_queue.push_back(std::move(queued));
+}
+
+int hwc_context::hwc_post(struct hwc_frame *frame, int32_t *out_fence)
+{
+	*out_fence = -1;
+	for (const auto &state : frame->planes) {
+		if (state.plane >= primary_output.planes.size() ||
+				private_handle_t::validate(state.hnd) < 0) {
+			close_fences(frame);
+			return -EINVAL;
+		}
+	}
+	if (frame->planes.empty() || frame->planes[0].plane != 0) {
+		close_fences(frame);
+		return -EINVAL;
+	}
+	/*
+	 * The fbs are looked up here, the handles are the client's and may
+	 * be freed once presentDisplay returns: the commit thread only gets
+	 * fb ids.
+	 */
+	{
+		std::lock_guard<std::mutex> lock(fb_lock);
+		release_fbs_locked();
+		/* 0 stands for never committed */
+		if (!++frame_count)
+			++frame_count;
+		for (auto &state : frame->planes) {
+			int err = get_fb_locked(state.hnd, frame_count, &state.fb_id);
+			if (err) {
+				ALOGE("%s: could not create drm fb, (%s)",
+					__func__, strerror(-err));
+				ALOGE("unable to post %p without fb", state.hnd);
+				close_fences(frame);
+				return err;
+			}
+			state.hnd = NULL;
+		}
+		frame->stamp = frame_count;
+	}
+
+	frame->mode = primary_output.mode;
+	for (auto &state : frame->planes) {
+		scale_to_mode(&state);
+		if ((int32_t)state.plane == primary_output.cursor_plane) {
+			std::lock_guard<std::mutex> lock(cursor_lock);
+			cursor_x = state.crtc_x;
+			cursor_y = state.crtc_y;
 		}
-		*out_fence = -1;
+	}
+
+	if (present_timeline < 0) {
+		/* no sw_sync: commit on the caller's thread, the fence is OUT_FENCE_PTR */
+		if (frame->present_time)
+			wait_present_time(frame->present_time);
+		int ret = post_frame(frame, out_fence, 0);
+		close_fences(frame);
 		return ret;
 	}
 
-	ret = atomic_commit(&primary_output, hnd, out_fence);
-	ALOGV("hwc_post() fd %d, fb_id %d, out_fence %d",
-		hnd->fd, hnd->fb_id, *out_fence);
+	std::lock_guard<std::mutex> lock(commit_lock);
+	uint32_t seq = ++commit_next_seq;
+	int fence = sw_sync_fence_create(present_timeline, "hwc_present", seq);
+	if (fence < 0) {
+		ALOGE("hwc_post() failed to create present fence (%s)", strerror(errno));
+	}
+	if (!commit_queue.empty() && !frame->present_time &&
+			!commit_queue.back().frame.present_time) {
+		/* not committed yet: latest wins, its fence signals with ours */
+		struct queued_frame *last = &commit_queue.back();
+		ALOGV("hwc_post() frame %u replaced by %u", last->seq, seq);
+		merge_damage(frame, &last->frame);
+		close_fences(&last->frame);
+		last->frame = std::move(*frame);
+		last->seq = seq;
+	} else {
+		queue_frame_locked({std::move(*frame), seq});
+	}
+	commit_cond.notify_one();
 
-    return ret;
+	*out_fence = fence;
+	return 0;
+}
+
+/*
+ * The same frame again: nothing to commit, its present fence signals
+ * with the vblank it is meant for, or together with a frame still
+ * waiting for asap.
+ */
+int hwc_context::hwc_repeat(int32_t *out_fence, int64_t present_time)
+{
+	*out_fence = -1;
+	if (present_timeline < 0)
+		return -ENOTSUP;
+
+	std::lock_guard<std::mutex> lock(commit_lock);
+	uint32_t seq = ++commit_next_seq;
+	int fence = sw_sync_fence_create(present_timeline, "hwc_present", seq);
+	if (fence < 0) {
+		ALOGE("hwc_repeat() failed to create present fence (%s)", strerror(errno));
+	}
+	if (!commit_queue.empty() && !present_time && !commit_queue.back().frame.present_time) {
+		/* an idle drop still waiting is cancelled */
+		commit_queue.back().frame.mode = primary_output.mode;
+		commit_queue.back().frame.idle = false;
+		commit_queue.back().seq = seq;
+	} else {
+		/* an empty frame tells the commit thread, its mode ends an idle drop */
+		struct queued_frame repeat;
+		repeat.frame.present_time = present_time;
+		repeat.frame.mode = primary_output.mode;
+		repeat.seq = seq;
+		queue_frame_locked(std::move(repeat));
+		commit_cond.notify_one();
+	}
+
+	*out_fence = fence;
+	return 0;
+}
+
+int hwc_context::hwc_idle()
+{
+	if (present_timeline < 0)
+		return -ENOTSUP;
+
+	std::lock_guard<std::mutex> lock(commit_lock);
+	if (idle_modes.empty())
+		return -ENOTSUP;
+	if (!commit_queue.empty())
+		return -EBUSY;
+	/* nothing to signal, seq 0 is never ahead of the timeline */
+	struct queued_frame idle;
+	idle.frame.idle = true;
+	idle.seq = 0;
+	commit_queue.push_back(std::move(idle));
+	commit_cond.notify_one();
+	return 0;
+}
+
+/*
+ * On the commit thread, against the mode on the crtc. An idle drop that
+ * needs a modeset would blank the screen, worse than the power it saves.
+ */
+bool hwc_context::pick_idle_mode(const std::vector<drmModeModeInfo> &candidates,
+		drmModeModeInfo *mode)
+{
+	if (crtc_idle || first_post)
+		return false;
+	for (const auto &m : candidates) {
+		if (m.hdisplay != primary_output.crtc_mode.hdisplay ||
+				m.vdisplay != primary_output.crtc_mode.vdisplay)
+			continue;
+		if (test_mode(&m)) {
+			*mode = m;
+			return true;
+		}
+		ALOGV("idle mode %s@%d needs a modeset", m.name, m.vrefresh);
+	}
+	return false;
+}
+
+/* some config has a slower mode of its size to drop to */
+bool hwc_context::idle_supported()
+{
+	if (present_timeline < 0)
+		return false;
+	for (const auto &a : primary_output.modes) {
+		for (const auto &b : primary_output.modes) {
+			if (a.hdisplay == b.hdisplay && a.vdisplay == b.vdisplay &&
+					mode_period_ns(&a) != mode_period_ns(&b))
+				return true;
+		}
+	}
+	return false;
+}
+
+void hwc_context::set_idle_callback(idle_callback_t callback, void *data)
+{
+	std::lock_guard<std::mutex> lock(commit_lock);
+	idle_callback = callback;
+	idle_data = data;
+}
+
+/* what is on screen again, in frame->mode; the fbs are still held */
+int hwc_context::refresh_mode(struct hwc_frame *frame, uint32_t present_seq)
+{
+	frame->planes = screen_planes;
+	frame->stamp = screen_stamp;
+	ALOGV("refresh_mode() %s@%d%s", frame->mode.name, frame->mode.vrefresh,
+			frame->idle ? " idle" : "");
+	return atomic_commit(&primary_output, frame, NULL, present_seq, true);
+}
+
+static uint32_t vblank_pipe_flags(uint32_t pipe)
+{
+	if (pipe > 1)
+		return (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+	return pipe == 1 ? DRM_VBLANK_SECONDARY : 0;
+}
+
+int64_t hwc_context::vsync_period()
+{
+	return mode_period;
+}
+
+/*
+ * The vblank counter value of the vblank closest to present_time, SF
+ * predicts vsync timestamps with some jitter. False if that is the next
+ * vblank or one already past, or the counter can't be read.
+ */
+bool hwc_context::target_vblank(int64_t present_time, uint32_t *sequence)
+{
+	drmVBlank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
+			vblank_pipe_flags(primary_output.pipe));
+	vbl.request.sequence = 0;
+	if (drmWaitVBlank(kms_fd, &vbl))
+		return false;
+
+	int64_t last = (int64_t)vbl.reply.tval_sec * 1000000000LL +
+			(int64_t)vbl.reply.tval_usec * 1000LL;
+	/* the crtc may be in an idle drop */
+	int64_t period = mode_period_ns(&primary_output.crtc_mode);
+	int64_t count = (present_time - last + period / 2) / period;
+	if (count <= 1)
+		return false;
+	/* a stale or bogus time must not stall the display */
+	if (count > 1000000000LL / period) {
+		ALOGW("present time %" PRId64 " ns ahead ignored", present_time - last);
+		return false;
+	}
+	*sequence = vbl.reply.sequence + (uint32_t)count;
+	return true;
+}
+
+/* a commit shows from the vblank after it on, so wait for the one before */
+void hwc_context::wait_present_time(int64_t present_time)
+{
+	uint32_t sequence;
+	if (!target_vblank(present_time, &sequence))
+		return;
+
+	drmVBlank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_ABSOLUTE |
+			vblank_pipe_flags(primary_output.pipe));
+	vbl.request.sequence = sequence - 1;
+	ALOGV("wait_present_time() vblank %u", sequence - 1);
+	if (drmWaitVBlank(kms_fd, &vbl))
+		ALOGW("wait_present_time() vblank %u failed (%s)", sequence - 1, strerror(errno));
+}
+
+/* frames committed before signal first, so the timeline stays in order */
+void hwc_context::repeat_frame(uint32_t present_seq, int64_t present_time)
+{
+	wait_flip_done();
+
+	drmVBlank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	uint32_t sequence;
+	if (present_time && target_vblank(present_time, &sequence)) {
+		vbl.request.type = DRM_VBLANK_ABSOLUTE;
+		vbl.request.sequence = sequence;
+	} else {
+		vbl.request.type = DRM_VBLANK_RELATIVE;
+		vbl.request.sequence = 1;
+	}
+	vbl.request.type = (drmVBlankSeqType)(vbl.request.type | DRM_VBLANK_EVENT |
+			vblank_pipe_flags(primary_output.pipe));
+	vbl.request.signal = (unsigned long)this;
+
+	std::lock_guard<std::mutex> lock(flip_lock);
+	vblank_present_seq = present_seq;
+	if (drmWaitVBlank(kms_fd, &vbl)) {
+		/* no vblank interrupt, the picture is up already */
+		signal_present_locked(present_seq);
+		vblank_present_seq = 0;
+	}
+}
+
+void hwc_context::vblank_handler(int /*fd*/, unsigned int /*sequence*/,
+		unsigned int /*tv_sec*/, unsigned int /*tv_usec*/, void *user_data)
+{
+	hwc_context *ctx = (hwc_context *)user_data;
+	std::lock_guard<std::mutex> lock(ctx->flip_lock);
+	ctx->signal_present_locked(ctx->vblank_present_seq);
+	ctx->vblank_present_seq = 0;
+}
+
+uint32_t hwc_context::plane_count()
+{
+	if (primary_output.cursor_plane >= 0)
+		return (uint32_t)primary_output.cursor_plane;
+	return primary_output.planes.size();
+}
+
+int32_t hwc_context::cursor_plane()
+{
+	return primary_output.cursor_plane;
+}
+
+/*
+ * The legacy cursor ioctl applies outside of the frame cycle, even with a
+ * flip pending. It shows the whole fb unscaled, so that's all the cursor
+ * plane takes.
+ */
+int hwc_context::move_cursor(int32_t x, int32_t y)
+{
+	if (primary_output.cursor_plane < 0)
+		return -ENODEV;
+
+	std::lock_guard<std::mutex> lock(cursor_lock);
+	cursor_x = x;
+	cursor_y = y;
+	if (!cursor_enabled)
+		return 0;
+	if (drmModeMoveCursor(kms_fd, primary_output.crtc_id, x, y))
+		return -errno;
+	return 0;
+}
+
+static bool format_has_alpha(uint32_t fourcc)
+{
+	return fourcc == DRM_FORMAT_ABGR8888 || fourcc == DRM_FORMAT_ARGB8888;
+}
+
+bool hwc_context::plane_check(const struct kms_plane_state *state)
+{
+	if (state->plane >= primary_output.planes.size())
+		return false;
+	const struct kms_plane *plane = &primary_output.planes[state->plane];
+	const private_handle_t *hnd = state->hnd;
+
+	uint32_t fourcc = drm_format_fourcc(hnd->format);
+	if (std::find(plane->formats.begin(), plane->formats.end(), fourcc) ==
+			plane->formats.end())
+		return false;
+	if (plane->type == DRM_PLANE_TYPE_CURSOR &&
+			(width != primary_output.mode.hdisplay ||
+			height != primary_output.mode.vdisplay ||
+			state->src_x || state->src_y ||
+			state->src_w != (uint32_t)hnd->width << 16 ||
+			state->src_h != (uint32_t)hnd->height << 16 ||
+			state->crtc_w != (uint32_t)hnd->width ||
+			state->crtc_h != (uint32_t)hnd->height ||
+			state->crtc_w > primary_output.cursor_w ||
+			state->crtc_h > primary_output.cursor_h))
+		return false;
+
+	/* scaling and clipping are up to the driver, test_frame() asks it */
+	int32_t fb_w = (int32_t)width;
+	int32_t fb_h = (int32_t)height;
+	if (!state->crtc_w || !state->crtc_h || !state->src_w || !state->src_h ||
+			state->crtc_x >= fb_w || state->crtc_y >= fb_h ||
+			state->crtc_x + (int32_t)state->crtc_w <= 0 ||
+			state->crtc_y + (int32_t)state->crtc_h <= 0)
+		return false;
+	if ((uint64_t)state->src_x + state->src_w > ((uint64_t)hnd->width << 16) ||
+			(uint64_t)state->src_y + state->src_h > ((uint64_t)hnd->height << 16))
+		return false;
+
+	if (state->alpha != 0xffff && !plane->prop_alpha)
+		return false;
+	/* over the black background none and pre-multiplied look the same */
+	if (plane->type == DRM_PLANE_TYPE_PRIMARY && state->blend != KMS_BLEND_COVERAGE)
+		return true;
+	if (plane->prop_blend_mode)
+		return plane->blend_modes & (1 << state->blend);
+	/* without the property planes blend pre-multiplied, if at all */
+	return state->blend == KMS_BLEND_PREMULTI ||
+			(state->blend == KMS_BLEND_NONE && !format_has_alpha(fourcc));
+}
+
+int hwc_context::wait_vblank(int64_t *timestamp)
+{
+	if (kms_fd < 0)
+		return -ENODEV;
+
+	drmVBlank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
+			vblank_pipe_flags(primary_output.pipe));
+	vbl.request.sequence = 1;
+	int ret = drmWaitVBlank(kms_fd, &vbl);
+	if (ret)
+		return -errno;
+
+	*timestamp = (int64_t)vbl.reply.tval_sec * 1000000000LL +
+			(int64_t)vbl.reply.tval_usec * 1000LL;
+	return 0;
 }
 
 #define MARGIN_PERCENT 1.8   /* % of active vertical image*/
@@ -189,7 +1383,7 @@ int hwc_context::hwc_post(buffer_handle_t buffer, int32_t *out_fence)
 #define C_PRIME   (((C - J) * K / 256.0) + J)
 #define M_PRIME   (K / 256.0 * M)
 
-static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq)
+static drmModeModeInfo generate_mode(int h_pixels, int v_lines, float freq)
 {
 	float h_pixels_rnd;
 	float v_lines_rnd;
@@ -220,7 +1414,8 @@ static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq)
 	int interlaced = 0;
 	int margins = 0;
 
-	drmModeModeInfoPtr m = (drmModeModeInfoPtr) malloc(sizeof(drmModeModeInfo));
+	drmModeModeInfo mode = {};
+	drmModeModeInfo *m = &mode;
 
 	h_pixels_rnd = rint((float) h_pixels / CELL_GRAN) * CELL_GRAN;
 	v_lines_rnd = interlaced ? rint((float) v_lines) / 2.0 : rint((float) v_lines);
@@ -262,14 +1457,31 @@ static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq)
 	m->vrefresh = freq;
 	m->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_PVSYNC;
 	m->type = DRM_MODE_TYPE_DRIVER;
+	snprintf(m->name, sizeof(m->name), "%dx%d", m->hdisplay, m->vdisplay);
 
-	return (m);
+	return mode;
+}
+
+/* the same picture timing, names and type flags aside */
+static bool same_timing(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+			a->hdisplay == b->hdisplay && a->hsync_start == b->hsync_start &&
+			a->hsync_end == b->hsync_end && a->htotal == b->htotal &&
+			a->hskew == b->hskew &&
+			a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+			a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+			a->vscan == b->vscan && a->flags == b->flags;
 }
 
-static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector)
+/*
+ * Index of the mode to use in modes, modes.size() for a forced mode
+ * that isn't among them and was generated into *forced, -1 if none.
+ */
+static int find_mode(const std::vector<drmModeModeInfo> &modes, drmModeModeInfo *forced)
 {
 	char value[PROPERTY_VALUE_MAX];
-	drmModeModeInfoPtr mode;
+	const drmModeModeInfo *mode;
 	int dist = INT_MAX, i;
 	int xres = 0, yres = 0, rate = 0;
 	int forcemode = 0;
@@ -302,8 +1514,8 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector)
 	}
 
 	if (xres && yres && rate) {
-		for (i = 0; i < connector->count_modes; i++) {
-			drmModeModeInfoPtr m = &connector->modes[i];
+		for (i = 0; i < (int)modes.size(); i++) {
+			const drmModeModeInfo *m = &modes[i];
 			if ((m->hdisplay == xres) && (m->vdisplay == yres)
 					&& (m->vrefresh == rate)) {
 				mode = m;
@@ -315,12 +1527,13 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector)
 	}
 
 	if (!found_prop_match) {
-		if (forcemode)
-			mode = generate_mode(xres, yres, rate);
-		else {
+		if (forcemode) {
+			*forced = generate_mode(xres, yres, rate);
+			mode = forced;
+		} else {
 			mode = NULL;
-			for (i = 0; i < connector->count_modes; i++) {
-				drmModeModeInfoPtr m = &connector->modes[i];
+			for (i = 0; i < (int)modes.size(); i++) {
+				const drmModeModeInfo *m = &modes[i];
 				int tmp;
 
 				if (xres && yres) {
@@ -341,104 +1554,212 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector)
 			}
 		}
 		/* fallback to the first mode */
-		if (!mode)
-			mode = &connector->modes[0];
+		if (!mode && !modes.empty())
+			mode = &modes[0];
 	}
+	if (!mode)
+		return -1;
 
 	ALOGV("Established mode:");
 	ALOGV("clock: %d, hdisplay: %d, hsync_start: %d, hsync_end: %d, htotal: %d, hskew: %d", mode->clock, mode->hdisplay, mode->hsync_start, mode->hsync_end, mode->htotal, mode->hskew);
 	ALOGV("vdisplay: %d, vsync_start: %d, vsync_end: %d, vtotal: %d, vscan: %d, vrefresh: %d", mode->vdisplay, mode->vsync_start, mode->vsync_end, mode->vtotal, mode->vscan, mode->vrefresh);
 	ALOGV("flags: %d, type: %d, name %s", mode->flags, mode->type, mode->name);
 
-	return mode;
+	return mode == forced ? (int)modes.size() : (int)(mode - modes.data());
 }
 
 /*
- * Initialize KMS with a connector.
+ * Look up what a plane can do.
  */
-int hwc_context::init_with_connector(struct kms_output *output,
-		drmModeConnectorPtr connector) {
-	drmModeEncoderPtr encoder;
-	drmModeModeInfoPtr mode;
-	static int used_crtcs = 0;
-	int i, j;
-
-	encoder = drmModeGetEncoder(kms_fd, connector->encoders[0]);
-	if (!encoder)
-		return -EINVAL;
-
-	/* find first possible crtc which is not used yet */
-	for (i = 0; i < resources->count_crtcs; i++) {
-		if (encoder->possible_crtcs & (1 << i) &&
-			(used_crtcs & (1 << i)) != (1 << i))
-			break;
-	}
+int hwc_context::init_plane(struct kms_plane *plane, const struct kms_plane_info *info)
+{
+	static const char *blend_names[KMS_BLEND_COUNT] = {
+		"None", "Pre-multiplied", "Coverage",
+	};
 
-	used_crtcs |= (1 << i);
+	*plane = {};
+	plane->id = info->id;
+	plane->formats = info->formats;
 
-	drmModeFreeEncoder(encoder);
-	if (i == resources->count_crtcs)
+	const kms_prop *type = info->prop("type");
+	if (!type)
 		return -EINVAL;
-
-	/* find primary plane id */
-	bool found_primary = false;
-	output->plane_id = 0;
-	for (j = 0; j < plane_resources->count_planes && !found_primary; j++) {
-		uint32_t plane_id = plane_resources->planes[j];
-		drmModePlanePtr plane = drmModeGetPlane(kms_fd, plane_resources->planes[j]);
-		if (!plane) {
-			ALOGW("drmModeGetPlane(%u) failed", plane_resources->planes[j]);
-			continue;
+	plane->type = (uint32_t)type->value;
+	plane->prop_fb_id = info->prop_id("FB_ID");
+	plane->prop_crtc_id = info->prop_id("CRTC_ID");
+	plane->prop_src_x = info->prop_id("SRC_X");
+	plane->prop_src_y = info->prop_id("SRC_Y");
+	plane->prop_src_w = info->prop_id("SRC_W");
+	plane->prop_src_h = info->prop_id("SRC_H");
+	plane->prop_crtc_x = info->prop_id("CRTC_X");
+	plane->prop_crtc_y = info->prop_id("CRTC_Y");
+	plane->prop_crtc_w = info->prop_id("CRTC_W");
+	plane->prop_crtc_h = info->prop_id("CRTC_H");
+	plane->prop_in_fence = info->prop_id("IN_FENCE_FD");
+	plane->prop_alpha = info->prop_id("alpha");
+	plane->prop_damage_clips = info->prop_id("FB_DAMAGE_CLIPS");
+
+	const kms_prop *zpos = info->prop("zpos");
+	if (zpos) {
+		plane->prop_zpos = zpos->id;
+		plane->zpos = zpos->value;
+		plane->zpos_mutable = !(zpos->flags & DRM_MODE_PROP_IMMUTABLE);
+		if (zpos->values.size() >= 2) {
+			plane->zpos_min = zpos->values[0];
+			plane->zpos_max = zpos->values[1];
 		}
-		if (plane->possible_crtcs & (1 << i)) {
-			drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(kms_fd,
-					plane_resources->planes[j], DRM_MODE_OBJECT_PLANE);
-			if (get_property_value(kms_fd, props, "type") == DRM_PLANE_TYPE_PRIMARY) {
-				found_primary = true;
-				output->plane_id = plane_id;
-				output->prop_fb_id = get_property_id(kms_fd, props, "FB_ID");
-				output->prop_crtc_id = get_property_id(kms_fd, props, "CRTC_ID");
-				ALOGI("found primary plane %u, fb %u, crtc %u", plane_id,
-				        output->prop_fb_id, output->prop_crtc_id);
-			}
-			drmModeFreeObjectProperties(props);
+	}
+	const kms_prop *blend = info->prop("pixel blend mode");
+	if (blend) {
+		plane->prop_blend_mode = blend->id;
+		for (int b = 0; b < KMS_BLEND_COUNT; b++) {
+			if (blend->enum_value(blend_names[b], &plane->blend_values[b]))
+				plane->blend_modes |= 1 << b;
 		}
-		drmModeFreePlane(plane);
 	}
 
-	output->crtc_id = resources->crtcs[i];
-	drmModeObjectPropertiesPtr crtc_props = drmModeObjectGetProperties(kms_fd,
-			output->crtc_id, DRM_MODE_OBJECT_CRTC);
-	output->prop_out_fence = get_property_id(kms_fd, crtc_props, "OUT_FENCE_PTR");
-	ALOGI("prop_out_fence %u", output->prop_out_fence);
-	drmModeFreeObjectProperties(crtc_props);
+	if (!plane->prop_fb_id || !plane->prop_crtc_id || !plane->prop_src_x ||
+			!plane->prop_crtc_x)
+		return -EINVAL;
+	return 0;
+}
 
-	output->connector_id = connector->connector_id;
-	output->pipe = i;
+/*
+ * The modes of a connector are the configs, the active one is picked by
+ * find_mode().
+ */
+int hwc_context::init_modes(struct kms_output *output,
+		const struct kms_connector_info *connector)
+{
+	drmModeModeInfo forced;
 
 	/* print connector info */
-	ALOGI("there are %d modes on connector 0x%x, type %d",
-		connector->count_modes,
-		connector->connector_id,
-		connector->connector_type);
-	for (i = 0; i < connector->count_modes; i++) {
-		ALOGV("  %s@%dHz flags:0x%x type:0x%x", connector->modes[i].name, connector->modes[i].vrefresh,
-				connector->modes[i].flags, connector->modes[i].type);
+	ALOGI("there are %zu modes on connector 0x%x, type %u",
+		connector->modes.size(), connector->id, connector->type);
+	for (const auto &m : connector->modes) {
+		ALOGV("  %s@%dHz flags:0x%x type:0x%x", m.name, m.vrefresh, m.flags, m.type);
 	}
 
-	mode = find_mode(connector);
-	ALOGI("the best mode is %s", mode->name);
+	int index = find_mode(connector->modes, &forced);
+	if (index < 0) {
+		ALOGE("no mode on connector %u", connector->id);
+		return -EINVAL;
+	}
 
-	output->mode = *mode;
+	/* every mode is a config, a forced mode is added as the last one */
+	output->modes = connector->modes;
+	if (index == (int)output->modes.size())
+		output->modes.push_back(forced);
+	output->mode_index = index;
+	output->mode = output->modes[index];
+	ALOGI("the best mode is %s", output->mode.name);
 	output->drm_format = DRM_FORMAT_ABGR8888;
+	output->mm_width = connector->mm_width;
+	output->mm_height = connector->mm_height;
+
+	return 0;
+}
 
-	if (connector->mmWidth && connector->mmHeight) {
-		output->xdpi = (output->mode.hdisplay * 25.4 / connector->mmWidth);
-		output->ydpi = (output->mode.vdisplay * 25.4 / connector->mmHeight);
+/*
+ * Initialize KMS with a connector.
+ */
+int hwc_context::init_with_connector(struct kms_output *output,
+		const struct kms_connector_info *connector) {
+	const drmModeModeInfo *mode;
+	static uint32_t used_crtcs = 0;
+
+	/* first possible crtc not used yet, the one already driving the connector first */
+	const struct kms_crtc_info *crtc = NULL;
+	const struct kms_crtc_info *boot_crtc = kms.crtc(connector->crtc_id);
+	if (boot_crtc && connector->possible_crtcs & (1 << boot_crtc->index) &&
+			!(used_crtcs & (1 << boot_crtc->index))) {
+		crtc = boot_crtc;
+	} else {
+		boot_crtc = NULL;
+		for (const auto &c : kms.crtcs) {
+			if (connector->possible_crtcs & (1 << c.index) &&
+					!(used_crtcs & (1 << c.index))) {
+				crtc = &c;
+				break;
+			}
+		}
+	}
+	if (!crtc)
+		return -EINVAL;
+	used_crtcs |= 1 << crtc->index;
+
+	/* the primary plane, then overlays bottom to top, the cursor on top */
+	struct kms_plane cursor = {};
+	output->planes.clear();
+	for (const auto &info : kms.planes) {
+		struct kms_plane plane;
+		if (!(info.possible_crtcs & (1 << crtc->index)) || init_plane(&plane, &info))
+			continue;
+		/* left on by whoever had the display, the first commit turns it off */
+		plane.enabled = info.fb_id && info.crtc_id == crtc->id;
+		if (plane.type != DRM_PLANE_TYPE_CURSOR)
+			output->planes.push_back(plane);
+		else if (!cursor.id)
+			cursor = plane;
+	}
+	std::stable_sort(output->planes.begin(), output->planes.end(),
+			[](const kms_plane &a, const kms_plane &b) {
+		bool a_primary = a.type == DRM_PLANE_TYPE_PRIMARY;
+		bool b_primary = b.type == DRM_PLANE_TYPE_PRIMARY;
+		if (a_primary != b_primary)
+			return a_primary;
+		return a.zpos < b.zpos;
+	});
+	if (output->planes.empty() || output->planes[0].type != DRM_PLANE_TYPE_PRIMARY) {
+		ALOGE("no primary plane for crtc %u", crtc->id);
+		return -EINVAL;
 	}
-	else {
-		output->xdpi = 75;
-		output->ydpi = 75;
+	/* a second primary can't go above the first one */
+	while (output->planes.size() > 1 &&
+			output->planes.back().type == DRM_PLANE_TYPE_PRIMARY)
+		output->planes.pop_back();
+	output->cursor_plane = -1;
+	if (cursor.id) {
+		uint64_t cursor_w = 64, cursor_h = 64;
+		drmGetCap(kms_fd, DRM_CAP_CURSOR_WIDTH, &cursor_w);
+		drmGetCap(kms_fd, DRM_CAP_CURSOR_HEIGHT, &cursor_h);
+		output->cursor_w = (uint32_t)cursor_w;
+		output->cursor_h = (uint32_t)cursor_h;
+		output->cursor_plane = (int32_t)output->planes.size();
+		output->planes.push_back(cursor);
+		ALOGI("cursor plane %u, up to %ux%u", cursor.id, output->cursor_w,
+				output->cursor_h);
+	}
+	for (const auto &plane : output->planes) {
+		ALOGI("plane %u type %u, %zu formats, zpos %" PRIu64 "%s, alpha %u, blend 0x%x, in_fence %u, damage %u",
+				plane.id, plane.type, plane.formats.size(), plane.zpos,
+				plane.zpos_mutable ? "" : " (immutable)", plane.prop_alpha,
+				plane.blend_modes, plane.prop_in_fence, plane.prop_damage_clips);
+	}
+
+	output->crtc_id = crtc->id;
+	output->prop_out_fence = crtc->prop_id("OUT_FENCE_PTR");
+	output->prop_mode_id = crtc->prop_id("MODE_ID");
+	output->prop_active = crtc->prop_id("ACTIVE");
+	ALOGI("prop_out_fence %u", output->prop_out_fence);
+	output->prop_conn_crtc_id = connector->prop_id("CRTC_ID");
+
+	output->connector_id = connector->id;
+	output->pipe = crtc->index;
+
+	int ret = init_modes(output, connector);
+	if (ret)
+		return ret;
+	mode = &output->mode;
+
+	/* already showing the mode we want: adopt it, no modeset and no blank */
+	memset(&output->crtc_mode, 0, sizeof(output->crtc_mode));
+	if (boot_crtc && boot_crtc->mode_valid && same_timing(&boot_crtc->mode, mode)) {
+		ALOGI("adopting mode %s@%d on crtc %u", mode->name, mode->vrefresh,
+				boot_crtc->id);
+		output->crtc_mode = *mode;
+		if (boot_crtc->buffer_id)
+			probe_dirty_fb(boot_crtc->buffer_id);
 	}
 
 	return 0;
@@ -448,26 +1769,11 @@ int hwc_context::init_with_connector(struct kms_output *output,
 /*
  * Fetch a connector of particular type
  */
-drmModeConnectorPtr hwc_context::fetch_connector(uint32_t type)
-{
-	int i;
-	primary_connector = -1;
-
-	if (!resources)
-		return NULL;
-
-	for (i = 0; i < resources->count_connectors; i++) {
-		drmModeConnectorPtr connector =
-			connector = drmModeGetConnector(kms_fd,
-				resources->connectors[i]);
-		if (connector) {
-			if (connector->connector_type == type &&
-				connector->connection == DRM_MODE_CONNECTED) {
-				primary_connector = i;
-				return connector;
-			}
-			drmModeFreeConnector(connector);
-		}
+const struct kms_connector_info *hwc_context::fetch_connector(uint32_t type)
+{
+	for (const auto &connector : kms.connectors) {
+		if (connector.type == type && connector.connection == DRM_MODE_CONNECTED)
+			return &connector;
 	}
 	return NULL;
 }
@@ -477,8 +1783,7 @@ drmModeConnectorPtr hwc_context::fetch_connector(uint32_t type)
  */
 int hwc_context::init_kms()
 {
-	drmModeConnectorPtr primary;
-	int i;
+	const struct kms_connector_info *primary;
 
 	int ret = drmSetClientCap(kms_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
 	if (ret) {
@@ -492,86 +1797,239 @@ int hwc_context::init_kms()
 		return ret;
 	}
 
-	resources = drmModeGetResources(kms_fd);
-	if (!resources) {
-		ALOGE("failed to get modeset resources");
-		return -EINVAL;
-	}
-
-	plane_resources = drmModeGetPlaneResources(kms_fd);
-	if (!plane_resources) {
-		ALOGE("failed to get plane resources");
-		return -EINVAL;
-	}
+	ret = kms.snapshot(kms_fd);
+	if (ret)
+		return ret;
 
 	/* find the crtc/connector/mode to use */
 	primary = fetch_connector(DRM_MODE_CONNECTOR_HDMIA);
 	if (primary) {
 		init_with_connector(&primary_output, primary);
-		drmModeFreeConnector(primary);
 		primary_output.active = 1;
 	}
 
 	/* if still no connector, find first connected connector and try it */
-	int lastValidConnectorIndex = -1;
 	if (!primary_output.active) {
-
-		for (i = 0; i < resources->count_connectors; i++) {
-			drmModeConnectorPtr connector;
-
-			connector = drmModeGetConnector(kms_fd,
-					resources->connectors[i]);
-			if (connector) {
-				lastValidConnectorIndex = i;
-				if (connector->connection == DRM_MODE_CONNECTED) {
-					if (!init_with_connector(
-							&primary_output, connector))
-						break;
-				}
-
-				drmModeFreeConnector(connector);
+		const struct kms_connector_info *last_valid = NULL;
+		for (const auto &connector : kms.connectors) {
+			last_valid = &connector;
+			if (connector.connection == DRM_MODE_CONNECTED &&
+					!init_with_connector(&primary_output, &connector)) {
+				primary = &connector;
+				break;
 			}
 		}
 
 		/* if no connected connector found, try to enforce the use of the last valid one */
-		if (i == resources->count_connectors) {
-			if (lastValidConnectorIndex > -1) {
-				ALOGD("no connected connector found, enforcing the use of valid connector %d", lastValidConnectorIndex);
-				drmModeConnectorPtr connector = drmModeGetConnector(kms_fd, resources->connectors[lastValidConnectorIndex]);
-				init_with_connector(&primary_output, connector);
-				drmModeFreeConnector(connector);
+		if (!primary) {
+			if (last_valid) {
+				ALOGD("no connected connector found, enforcing the use of valid connector %u", last_valid->id);
+				init_with_connector(&primary_output, last_valid);
 			}
 			else {
 				ALOGE("failed to find a valid crtc/connector/mode combination");
-				drmModeFreeResources(resources);
-				resources = NULL;
-
 				return -EINVAL;
 			}
 		}
 	}
 
-	first_post = 1;
+	const struct kms_connector_info *connector = kms.connector(primary_output.connector_id);
+	primary_connected = connector && connector->connection == DRM_MODE_CONNECTED;
+	if (connector)
+		primary_modes = connector->modes;
+
+	/* a modeset with the first frame unless the boot mode was adopted */
+	first_post = !primary_output.crtc_mode.clock;
+	if (!first_post)
+		mode_period = mode_period_ns(&primary_output.crtc_mode);
+	return 0;
+}
+
+/*
+ * Let SF render at debug.drm.fb_size (<w>x<h>) and have the primary
+ * plane scale it to the mode, e.g. 1080p on a 4K panel.
+ */
+void hwc_context::init_fb_size()
+{
+	char value[PROPERTY_VALUE_MAX];
+	int w = 0, h = 0;
+
+	if (!property_get("debug.drm.fb_size", value, NULL) ||
+			sscanf(value, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)
+		return;
+
+	ALOGI("framebuffer %dx%d scaled to the mode", w, h);
+	fb_size_w = (uint32_t)w;
+	fb_size_h = (uint32_t)h;
+}
+
+uint32_t hwc_context::config_count()
+{
+	return primary_output.modes.size();
+}
+
+uint32_t hwc_context::active_config()
+{
+	return primary_output.mode_index;
+}
+
+int hwc_context::get_config(uint32_t config, struct hwc_config *out)
+{
+	if (config >= primary_output.modes.size())
+		return -EINVAL;
+
+	const drmModeModeInfo *mode = &primary_output.modes[config];
+	out->width = fb_size_w ? fb_size_w : mode->hdisplay;
+	out->height = fb_size_h ? fb_size_h : mode->vdisplay;
+	out->vsync_period = mode_period_ns(mode);
+	if (primary_output.mm_width && primary_output.mm_height) {
+		out->xdpi = out->width * 25.4f / primary_output.mm_width;
+		out->ydpi = out->height * 25.4f / primary_output.mm_height;
+	} else {
+		out->xdpi = 75.0f * out->width / mode->hdisplay;
+		out->ydpi = 75.0f * out->height / mode->vdisplay;
+	}
+
+	/* modes of one size only differ in refresh rate */
+	out->group = config;
+	for (uint32_t i = 0; i < config; i++) {
+		if (primary_output.modes[i].hdisplay == mode->hdisplay &&
+				primary_output.modes[i].vdisplay == mode->vdisplay) {
+			out->group = i;
+			break;
+		}
+	}
 	return 0;
 }
 
+int hwc_context::set_config(uint32_t config)
+{
+	struct hwc_config info;
+	int ret = get_config(config, &info);
+	if (ret)
+		return ret;
+
+	primary_output.mode = primary_output.modes[config];
+	primary_output.mode_index = config;
+	{
+		/* tested for the scale factor of the old config */
+		std::lock_guard<std::mutex> lock(fb_lock);
+		client_target_sizes.clear();
+	}
+	{
+		/* slower modes of the config's group, the commit thread tests them */
+		std::lock_guard<std::mutex> lock(commit_lock);
+		const drmModeModeInfo *active = &primary_output.mode;
+		idle_modes.clear();
+		for (const auto &m : primary_output.modes) {
+			if (m.hdisplay == active->hdisplay && m.vdisplay == active->vdisplay &&
+					mode_period_ns(&m) > mode_period_ns(active))
+				idle_modes.push_back(m);
+		}
+		std::stable_sort(idle_modes.begin(), idle_modes.end(),
+				[](const drmModeModeInfo &a, const drmModeModeInfo &b) {
+			return mode_period_ns(&a) > mode_period_ns(&b);
+		});
+	}
+	width = info.width;
+	height = info.height;
+	fps = 1e9f / info.vsync_period;
+	xdpi = info.xdpi;
+	ydpi = info.ydpi;
+	ALOGI("config %u: %s@%d, framebuffer %ux%u", config, primary_output.mode.name,
+			primary_output.mode.vrefresh, width, height);
+	return 0;
+}
+
+/*
+ * Without ALLOW_MODESET the kernel refuses any mode switch that would
+ * blank the crtc, so a passing test commit means the switch is seamless.
+ */
+bool hwc_context::config_seamless(uint32_t config)
+{
+	if (config >= primary_output.modes.size())
+		return false;
+	drmModeModeInfo crtc_mode = get_crtc_mode();
+	if (!memcmp(&primary_output.modes[config], &crtc_mode, sizeof(crtc_mode)))
+		return true;
+	return test_mode(&primary_output.modes[config]);
+}
+
+bool hwc_context::test_mode(const drmModeModeInfo *mode)
+{
+	if (!primary_output.prop_mode_id)
+		return false;
+
+	uint32_t blob_id;
+	if (drmModeCreatePropertyBlob(kms_fd, mode, sizeof(*mode), &blob_id))
+		return false;
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	drmModeAtomicAddProperty(req, primary_output.crtc_id, primary_output.prop_mode_id,
+			blob_id);
+	int ret = drmModeAtomicCommit(kms_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(req);
+	drmModeDestroyPropertyBlob(kms_fd, blob_id);
+	return ret == 0;
+}
+
 hwc_context::hwc_context() {
     char path[PROPERTY_VALUE_MAX];
     property_get("gralloc.drm.kms", path, "/dev/dri/card0");
 
     fps = 60.0;
+    fb_size_w = 0;
+    fb_size_h = 0;
+    mode_period = 1000000000LL / 60;
+    pending_mode_period = 0;
+    primary_output.mode_index = 0;
+    memset(&primary_output.crtc_mode, 0, sizeof(primary_output.crtc_mode));
+    first_post = 1;
+    flip_pending = false;
+    flip_sequence = 0;
+    flip_timestamp = 0;
+    fb_lru = 0;
+    fbs_released = false;
+    frame_count = 0;
+    frame_on_screen = 0;
+    screen_stamp = 0;
+    crtc_idle = false;
+    pending_frame = 0;
+    pending_present_seq = 0;
+    vblank_present_seq = 0;
+    primary_output.cursor_plane = -1;
+    primary_output.dirty_fb = false;
+    cursor_enabled = false;
+    cursor_x = 0;
+    cursor_y = 0;
+    commit_next_seq = 0;
+    present_signaled = 0;
+    present_timeline = -1;
+    primary_connected = false;
+    hotplug_callback = NULL;
+    hotplug_data = NULL;
+    idle_callback = NULL;
+    idle_data = NULL;
+    hotplug_pending = false;
     kms_fd = open(path, O_RDWR|O_CLOEXEC);
    	if (kms_fd > 0) {
    		int error = init_kms();
    	    if (error != 0) {
    	        ALOGE("failed hwc_init_kms() %d", error);
    	    } else {
-   	        width = (uint32_t)primary_output.mode.hdisplay;
-   	        height = (uint32_t)primary_output.mode.vdisplay;
-   	        fps = (float)primary_output.mode.vrefresh;
                 format = HAL_PIXEL_FORMAT_RGBA_8888;
-   	        xdpi = (float)primary_output.xdpi;
-   	        ydpi = (float)primary_output.ydpi;
+   	        init_fb_size();
+   	        set_config(primary_output.mode_index);
+   	        mode_period = mode_period_ns(&primary_output.mode);
+   	        event_thread = std::thread(&hwc_context::event_loop, this);
+   	        hotplug_thread = std::thread(&hwc_context::hotplug_loop, this);
+
+   	        present_timeline = sw_sync_timeline_create();
+   	        if (present_timeline >= 0) {
+   	            commit_thread = std::thread(&hwc_context::commit_loop, this);
+   	        } else {
+   	            ALOGW("no sw_sync timeline (%s), presenting synchronously",
+   	                    strerror(errno));
+   	        }
    	    }
     } else {
         ALOGE("hwc_context() failed to open %s", path);
@@ -19,36 +19,223 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <drm_handle.h>
 
+#include "kms_device.h"
+
 namespace aidl::android::hardware::graphics::composer3::impl {
 
+enum kms_blend
+{
+    KMS_BLEND_NONE,
+    KMS_BLEND_PREMULTI,
+    KMS_BLEND_COVERAGE,
+    KMS_BLEND_COUNT,
+};
+
+struct kms_plane
+{
+    uint32_t id;
+    uint32_t type;              /* DRM_PLANE_TYPE_* */
+    std::vector<uint32_t> formats;
+    uint64_t zpos;              /* initial value, overlays are sorted by it */
+    uint64_t zpos_min;
+    uint64_t zpos_max;
+    bool zpos_mutable;
+    uint32_t blend_modes;       /* bitmask of kms_blend the driver knows */
+    uint64_t blend_values[KMS_BLEND_COUNT];
+    bool enabled;               /* showing a buffer after the last commit */
+
+    uint32_t prop_fb_id;
+    uint32_t prop_crtc_id;
+    uint32_t prop_src_x;
+    uint32_t prop_src_y;
+    uint32_t prop_src_w;
+    uint32_t prop_src_h;
+    uint32_t prop_crtc_x;
+    uint32_t prop_crtc_y;
+    uint32_t prop_crtc_w;
+    uint32_t prop_crtc_h;
+    uint32_t prop_in_fence;     /* 0 if the driver can't wait on fences */
+    uint32_t prop_zpos;         /* 0 for the optional ones if absent */
+    uint32_t prop_alpha;
+    uint32_t prop_blend_mode;
+    uint32_t prop_damage_clips;
+};
+
+/* what one plane shows in a frame */
+struct kms_plane_state
+{
+    uint32_t plane;             /* index into kms_output::planes */
+    const private_handle_t *hnd;    /* cleared by hwc_post(), the client may free it */
+    uint32_t fb_id;             /* filled in by hwc_context */
+    int acquire_fence;          /* owned by the frame */
+    int32_t crtc_x, crtc_y;
+    uint32_t crtc_w, crtc_h;
+    uint32_t src_x, src_y;      /* 16.16 fixed point */
+    uint32_t src_w, src_h;
+    uint16_t alpha;             /* 0xffff is opaque */
+    enum kms_blend blend;
+    uint64_t source;            /* what the buffers come from, e.g. a layer */
+    /* changed since the source's last frame, in fb pixels; empty if all of it */
+    std::vector<struct drm_mode_rect> damage;
+};
+
+/*
+ * Bottom to top, planes[0] is always on the primary plane. The crtc
+ * rectangles are in framebuffer coordinates, see hwc_context::width.
+ */
+struct hwc_frame
+{
+    std::vector<kms_plane_state> planes;
+    int64_t present_time = 0;   /* CLOCK_MONOTONIC ns to show it at, 0 for asap */
+    drmModeModeInfo mode;       /* of the config it was built for, set by hwc_post() */
+    bool idle = false;          /* an idle refresh-rate drop, the commit thread picks the mode */
+    uint32_t stamp = 0;         /* of its fbs in the cache, set by hwc_post() */
+};
+
+struct kms_fb
+{
+    uint32_t fb_id;
+    uint32_t gem_handle;
+    uint64_t lru;
+    uint32_t frame;             /* last frame committed with it, 0 if none */
+    bool released;              /* the client let go of the buffer, goes once off screen */
+};
+
 struct kms_output
 {
-    uint32_t plane_id;
     uint32_t crtc_id;
     uint32_t connector_id;
     uint32_t pipe;
-    drmModeModeInfo mode;
-    int xdpi, ydpi;
+    drmModeModeInfo mode;       /* of the active config, frames are built for it */
+    std::vector<drmModeModeInfo> modes;  /* of the connector, a config each */
+    uint32_t mode_index;        /* mode is modes[mode_index] */
+    /*
+     * Programmed on the crtc. The commit thread writes it under
+     * flip_lock, other threads read it with get_crtc_mode().
+     */
+    drmModeModeInfo crtc_mode;
+    uint32_t mm_width, mm_height;
     uint32_t drm_format;
     int bpp;
     uint32_t active;
 
-    uint32_t prop_fb_id;
-    uint32_t prop_crtc_id;
+    /* usable on the crtc: the primary first, then overlays by zpos, the cursor last */
+    std::vector<struct kms_plane> planes;
+
+    int32_t cursor_plane;       /* index into planes, -1 without one */
+    uint32_t cursor_w, cursor_h;
+
+    bool dirty_fb;              /* manual update, the driver uploads on DirtyFB */
+
     uint32_t prop_out_fence;
+    uint32_t prop_mode_id;
+    uint32_t prop_active;
+    uint32_t prop_conn_crtc_id;
 };
 
 #ifndef ANDROID_HARDWARE_HWCOMPOSER2_H
 typedef uint64_t hwc2_display_t;
 #endif
 
+/* a display config, one per connector mode */
+struct hwc_config
+{
+    uint32_t width, height;     /* framebuffer size */
+    int64_t vsync_period;       /* ns */
+    float xdpi, ydpi;
+    int32_t group;              /* same size, configs only differ in refresh rate */
+};
+
 class hwc_context {
   public :
     hwc_context();
-    int hwc_post(buffer_handle_t handle, int32_t *out_fence);
+    /* takes ownership of the acquire fences in frame */
+    int hwc_post(struct hwc_frame *frame, int32_t *out_fence);
+    /*
+     * Present the last frame again, without a commit, present_time as in
+     * hwc_frame. -ENOTSUP without the present timeline: nothing would
+     * signal the fence, post the frame again instead.
+     */
+    int hwc_repeat(int32_t *out_fence, int64_t present_time);
+    /* planes below the cursor a frame may use, index 0 is the primary */
+    uint32_t plane_count();
+    /* index of the cursor plane, always above the others, or -1 */
+    int32_t cursor_plane();
+    /* new position of the cursor plane, shown right away */
+    int move_cursor(int32_t x, int32_t y);
+    /* cheap checks before a test commit: format, properties, bounds */
+    bool plane_check(const struct kms_plane_state *state);
+    /* TEST_ONLY commit of frame, -EAGAIN while the crtc isn't set up yet */
+    int test_frame(const struct hwc_frame *frame);
+    /* a client target of w x h in the framebuffer format can be scaled to it */
+    bool client_target_check(uint32_t w, uint32_t h);
+    /* create the fb of a buffer ahead of its first commit */
+    int import_buffer(buffer_handle_t buffer);
+    /* fb cache key of a buffer, 0 if it has none; the buffer needn't outlive it */
+    uint64_t buffer_key(buffer_handle_t buffer);
+    /* the client freed the buffer of key, its fb goes as soon as it is unused */
+    void release_buffer(uint64_t key);
+    /*
+     * Block until the next vblank of the primary CRTC, timestamp in
+     * CLOCK_MONOTONIC ns. Fails if the driver has no vblank interrupt
+     * or the CRTC is off.
+     */
+    int wait_vblank(int64_t *timestamp);
+    /* CLOCK_MONOTONIC ns of the last completed flip, 0 before the first one */
+    int64_t last_present_time();
+
+    uint32_t config_count();
+    int get_config(uint32_t config, struct hwc_config *out);
+    uint32_t active_config();
+    /*
+     * Frames posted from now on are for config, the first of them commits
+     * its mode. The public fields below follow right away.
+     */
+    int set_config(uint32_t config);
+    /* the mode switch needs no full modeset, a TEST_ONLY commit tells */
+    bool config_seamless(uint32_t config);
+    /* of the active config, changes with the flip that switches to it */
+    int64_t vsync_period();
+    /*
+     * Nothing was presented for a while: show the same picture at the
+     * lowest refresh rate of its size the crtc can switch to without a
+     * modeset, until the next hwc_post() or hwc_repeat(). -EBUSY if
+     * frames are still queued, -ENOTSUP if the config has no slower
+     * mode. The idle callback runs once the drop was committed.
+     */
+    int hwc_idle();
+    /* on the commit thread, the crtc runs at the idle rate from now on */
+    typedef void (*idle_callback_t)(void *data);
+    void set_idle_callback(idle_callback_t callback, void *data);
+    /*
+     * Some config has a slower mode to drop to, and the present
+     * timeline is there; hwc_idle() always fails otherwise.
+     */
+    bool idle_supported();
+
+    /* display 0 was plugged in again or has other modes, on the hotplug thread */
+    typedef void (*hotplug_callback_t)(void *data);
+    void set_hotplug_callback(hotplug_callback_t callback, void *data);
+    /*
+     * Switch to the configs of the connector last reported, true if
+     * there was one. Config calls and posts must be held off; the next
+     * frame does a full modeset.
+     */
+    bool apply_hotplug();
+    /* frames not committed yet are dropped, their present fences signal */
+    void drop_frames();
 
+    /* framebuffer size, the mode may be larger and scale it up */
     uint32_t  width;
     uint32_t  height;
     int       format;
@@ -58,19 +245,145 @@ class hwc_context {
 
   private:
     int init_kms();
-    drmModeConnectorPtr fetch_connector(uint32_t type);
+    const struct kms_connector_info *fetch_connector(uint32_t type);
     int init_with_connector(struct kms_output *output,
-    		drmModeConnectorPtr connector);
+    		const struct kms_connector_info *connector);
+
+    int init_modes(struct kms_output *output, const struct kms_connector_info *connector);
+    int init_plane(struct kms_plane *plane, const struct kms_plane_info *info);
+    void init_fb_size();
+    uint32_t fb_size_w, fb_size_h;  /* debug.drm.fb_size, 0 to follow the mode */
+    void scale_to_mode(struct kms_plane_state *state);
+
+    /*
+     * Composer-owned fbs, one per buffer, evicted least recently used
+     * first once FB_CACHE_SIZE are around. hwc_post() numbers frames in
+     * the order they are committed so an fb that is queued or may still
+     * be scanned out stays.
+     */
+    static constexpr size_t FB_CACHE_SIZE = 16;
+    int add_fb(const private_handle_t *hnd, struct kms_fb *fb);
+    int get_fb_locked(const private_handle_t *hnd, uint32_t frame, uint32_t *fb_id);
+    void evict_fbs_locked();
+    void remove_fb_locked(const struct kms_fb *fb);
+    void release_fbs_locked();
+    int test_commit(const struct hwc_frame *frame);
+    /* size of a scaled client target, w << 32 | h, and the driver's answer */
+    std::unordered_map<uint64_t, bool> client_target_sizes;  /* under fb_lock */
+    bool fbs_released;      /* some fbs still wait for their last frame to go */
+    std::mutex fb_lock;     /* test commits and imports come from the binder thread */
+    std::unordered_map<uint64_t, struct kms_fb> fb_cache;
+    uint64_t fb_lru;
+    uint32_t frame_count;
+    std::atomic<uint32_t> frame_on_screen;
+    std::atomic<int> first_post;
+    int atomic_commit(struct kms_output *output, struct hwc_frame *frame,
+        int32_t *out_fence, uint32_t present_seq, bool mode_change);
+    int post_frame(struct hwc_frame *frame, int32_t *out_fence, uint32_t present_seq);
+
+    /*
+     * What the last commit put on the planes, without fences. Damage is
+     * relative to it, so it only goes out for a plane that showed the
+     * same source, and a frame that only damages these fbs is flushed
+     * with DirtyFB on manual-update drivers instead of a commit.
+     */
+    bool damage_valid(const struct kms_plane_state *state);
+    bool same_planes(const struct hwc_frame *frame);
+    int flush_damage(struct kms_output *output, struct hwc_frame *frame);
+    void set_screen_planes(const struct hwc_frame *frame);
+    void probe_dirty_fb(uint32_t fb_id);
+    std::vector<struct kms_plane_state> screen_planes;
+    uint32_t screen_stamp;
+
+    /*
+     * Commits run on their own SCHED_FIFO thread so hwc_post() never
+     * blocks on a pending flip. A frame for asap replaces one for asap
+     * still waiting, and the present fence of the replaced frame
+     * signals together with the newer one; frames with a present time
+     * queue up, COMMIT_QUEUE_MAX at most, and are committed for the
+     * vblank of that time. Present
+     * fences are points on a sw_sync timeline, signaled from the flip
+     * event.
+     */
+    struct queued_frame
+    {
+        struct hwc_frame frame;     /* no planes for a repeat */
+        uint32_t seq;
+    };
+    static constexpr size_t COMMIT_QUEUE_MAX = 3;
+    void queue_frame_locked(struct queued_frame &&queued);
+    void commit_loop();
+    bool target_vblank(int64_t present_time, uint32_t *sequence);
+    void wait_present_time(int64_t present_time);
+    void repeat_frame(uint32_t present_seq, int64_t present_time);
+    void signal_present_locked(uint32_t seq);
+    std::thread commit_thread;
+    std::mutex commit_lock;
+    std::condition_variable commit_cond;
+    std::deque<struct queued_frame> commit_queue;
+    /* same size as the active config and slower, slowest first; under commit_lock */
+    std::vector<drmModeModeInfo> idle_modes;
+    idle_callback_t idle_callback;  /* under commit_lock */
+    void *idle_data;
+    bool pick_idle_mode(const std::vector<drmModeModeInfo> &candidates,
+        drmModeModeInfo *mode);
+    /* the crtc runs an idle drop from idle_from, commit thread only */
+    bool crtc_idle;
+    drmModeModeInfo idle_from;
+    bool test_mode(const drmModeModeInfo *mode);
+    int refresh_mode(struct hwc_frame *frame, uint32_t present_seq);
+    uint32_t commit_next_seq;
+    int present_timeline;
+    uint32_t present_signaled;   /* under flip_lock */
+
+    /*
+     * Flip completion, fed by the DRM event thread. At most one
+     * nonblocking commit may be in flight per CRTC, anything more
+     * fails with EBUSY, so commits wait for flip_pending to clear.
+     */
+    void event_loop();
+    static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+        unsigned int tv_usec, unsigned int crtc_id, void *user_data);
+    static void vblank_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+        unsigned int tv_usec, void *user_data);
+    void flip_complete(uint32_t crtc_id, uint32_t sequence, int64_t timestamp);
+    bool wait_flip_done();
+    std::thread event_thread;
+    std::mutex flip_lock;
+    std::condition_variable flip_cond;
+    bool flip_pending;
+    uint32_t flip_sequence;
+    int64_t flip_timestamp;
+    drmModeModeInfo get_crtc_mode();
+    uint32_t pending_frame;  /* committed, on screen after the next flip */
+    uint32_t pending_present_seq;
+    int64_t pending_mode_period;  /* the flip switches modes, 0 if not */
+    std::atomic<int64_t> mode_period;
+    uint32_t vblank_present_seq;  /* a repeated frame, signaled by a vblank event */
+
+    /* latest cursor position, commits of older frames use it too */
+    std::mutex cursor_lock;
+    bool cursor_enabled;
+    int32_t cursor_x, cursor_y;
 
-    int add_fb(const private_handle_t *hnd);
-    int first_post;
-    int atomic_commit(struct kms_output *output, const private_handle_t *hnd,
-        int32_t *out_fence);
+    /*
+     * Connector changes come as drm uevents. The hotplug thread probes
+     * them into kms and leaves a change of the primary connector to
+     * apply_hotplug(), which the callback runs with posts held off.
+     */
+    void hotplug_loop();
+    void probe_connectors();
+    std::thread hotplug_thread;
+    bool primary_connected;     /* hotplug thread only */
+    std::vector<drmModeModeInfo> primary_modes;  /* last reported, hotplug thread only */
+    std::mutex hotplug_lock;
+    hotplug_callback_t hotplug_callback;
+    void *hotplug_data;
+    bool hotplug_pending;
+    struct kms_connector_info hotplug_connector;
 
     int kms_fd;
-    drmModeResPtr resources;
-    drmModePlaneResPtr plane_resources;
-    int primary_connector;
+    kms_device kms;         /* taken at init and on hotplug, lookups don't go to the driver */
     struct kms_output primary_output;
 };
 
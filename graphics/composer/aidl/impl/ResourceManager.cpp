@@ -33,15 +33,57 @@ std::unique_ptr<IBufferReleaser> ResourceManager::createReleaser(bool isBuffer)
     return std::make_unique<BufferReleaser>(isBuffer);
 }
 
+void ResourceManager::setBufferListener(BufferKey bufferKey, BufferReleased bufferReleased) {
+    std::lock_guard<std::mutex> lock(mSlotLock);
+    mBufferKey = std::move(bufferKey);
+    mBufferReleased = std::move(bufferReleased);
+}
+
+// The handle the slot had is only kept by the releaser now, it may be
+// gone by the time the listener hears about it: only its key is passed.
+void ResourceManager::updateSlot(int64_t display, int64_t layer, uint32_t slot,
+                                 buffer_handle_t handle) {
+    std::lock_guard<std::mutex> lock(mSlotLock);
+    if (!mBufferKey) {
+        return;
+    }
+    CachedBuffer& cached = mSlots[{display, layer, slot}];
+    if (cached.handle == handle) {
+        return;
+    }
+    if (cached.handle && cached.key) {
+        mBufferReleased(cached.key);
+    }
+    cached.handle = handle;
+    cached.key = handle ? mBufferKey(handle) : 0;
+}
+
+// the slots of a layer, or every slot of the display without one
+void ResourceManager::releaseSlots(int64_t display, std::optional<int64_t> layer) {
+    std::lock_guard<std::mutex> lock(mSlotLock);
+    for (auto it = mSlots.begin(); it != mSlots.end();) {
+        if (std::get<0>(it->first) != display ||
+            (layer && std::get<1>(it->first) != *layer)) {
+            ++it;
+            continue;
+        }
+        if (it->second.handle && it->second.key && mBufferReleased) {
+            mBufferReleased(it->second.key);
+        }
+        it = mSlots.erase(it);
+    }
+}
+
 void ResourceManager::clear(RemoveDisplay removeDisplay) {
-    mResources->clear([removeDisplay](Display hwcDisplay, bool isVirtual,
-                                      const std::vector<Layer> hwcLayers) {
+    mResources->clear([this, removeDisplay](Display hwcDisplay, bool isVirtual,
+                                            const std::vector<Layer> hwcLayers) {
         int64_t display;
         std::vector<int64_t> layers;
         h2a::translate(hwcDisplay, display);
         h2a::translate(hwcLayers, layers);
 
         removeDisplay(display, isVirtual, layers);
+        releaseSlots(display, std::nullopt);
     });
 }
 
@@ -80,6 +122,7 @@ int32_t ResourceManager::removeDisplay(int64_t display) {
     a2h::translate(display, hwcDisplay);
 
     Error hwcErr = mResources->removeDisplay(hwcDisplay);
+    releaseSlots(display, std::nullopt);
 
     int32_t err;
     h2a::translate(hwcErr, err);
@@ -141,6 +184,7 @@ int32_t ResourceManager::removeLayer(int64_t display, int64_t layer) {
     a2h::translate(display, hwcDisplay);
     a2h::translate(layer, hwcLayer);
     Error hwcErr = mResources->removeLayer(hwcDisplay, hwcLayer);
+    releaseSlots(display, layer);
 
     int32_t err;
     h2a::translate(hwcErr, err);
@@ -187,6 +231,9 @@ int32_t ResourceManager::getDisplayClientTarget(int64_t display, uint32_t slot,
     auto br = static_cast<BufferReleaser*>(bufReleaser);
     Error hwcErr = mResources->getDisplayClientTarget(hwcDisplay, slot, fromCache, handle,
                                                       &outHandle, br->getReplacedHandle());
+    if (hwcErr == Error::NONE) {
+        updateSlot(display, -1, slot, outHandle);
+    }
 
     int32_t err;
     h2a::translate(hwcErr, err);
@@ -223,6 +270,9 @@ int32_t ResourceManager::getLayerBuffer(int64_t display, int64_t layer, uint32_t
     Error hwcErr = mResources->getLayerBuffer(hwcDisplay, hwcLayer, slot, fromCache,
                                                 rawHandle, &outBufferHandle,
                                                 br->getReplacedHandle());
+    if (hwcErr == Error::NONE) {
+        updateSlot(display, layer, slot, outBufferHandle);
+    }
 
     int32_t err;
     h2a::translate(hwcErr, err);
@@ -16,6 +16,11 @@
 
 #pragma once
 
+#include <map>
+#include <mutex>
+#include <optional>
+#include <tuple>
+
 #include <composer-resources/2.2/ComposerResources.h>
 
 #include "include/IResourceManager.h"
@@ -42,6 +47,7 @@ class ResourceManager : public IResourceManager {
     virtual ~ResourceManager() = default;
 
     std::unique_ptr<IBufferReleaser> createReleaser(bool isBuffer) override;
+    void setBufferListener(BufferKey bufferKey, BufferReleased bufferReleased) override;
     void clear(RemoveDisplay removeDisplay) override;
     bool hasDisplay(int64_t display) override;
     int32_t addPhysicalDisplay(int64_t display) override;
@@ -74,6 +80,20 @@ class ResourceManager : public IResourceManager {
                                    IBufferReleaser* bufReleaser) override;
   private:
     std::unique_ptr<ComposerResources> mResources = ComposerResources::create();
+
+    // ComposerResources doesn't tell what it frees, so the slots are
+    // shadowed here. The client target is layer -1.
+    using Slot = std::tuple<int64_t, int64_t, uint32_t>;
+    struct CachedBuffer {
+        buffer_handle_t handle;
+        uint64_t key;
+    };
+    void updateSlot(int64_t display, int64_t layer, uint32_t slot, buffer_handle_t handle);
+    void releaseSlots(int64_t display, std::optional<int64_t> layer);
+    std::mutex mSlotLock;
+    std::map<Slot, CachedBuffer> mSlots;
+    BufferKey mBufferKey;
+    BufferReleased mBufferReleased;
 };
 
 } // namespace aidl::android::hardware::graphics::composer3::impl
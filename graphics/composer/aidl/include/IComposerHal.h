@@ -35,6 +35,7 @@
 #include <aidl/android/hardware/graphics/composer3/ClientTarget.h>
 #include <aidl/android/hardware/graphics/composer3/ClientTargetProperty.h>
 #include <aidl/android/hardware/graphics/composer3/ClientTargetPropertyWithBrightness.h>
+#include <aidl/android/hardware/graphics/composer3/ClockMonotonicTimestamp.h>
 #include <aidl/android/hardware/graphics/composer3/Color.h>
 #include <aidl/android/hardware/graphics/composer3/ColorMode.h>
 #include <aidl/android/hardware/graphics/composer3/CommandError.h>
@@ -104,14 +105,28 @@ class IComposerHal {
     virtual void registerEventCallback(EventCallback* callback) = 0;
     virtual void unregisterEventCallback() = 0;
 
+    // what the display derived from a buffer of the client's caches, see
+    // IResourceManager::setBufferListener()
+    virtual uint64_t getBufferKey(buffer_handle_t buffer) = 0;
+    virtual void releaseBuffer(uint64_t key) = 0;
+
     virtual int32_t acceptDisplayChanges(int64_t display) = 0;
     virtual int32_t createLayer(int64_t display, int64_t* outLayer) = 0;
     virtual int32_t destroyLayer(int64_t display, int64_t layer) = 0;
     virtual int32_t getDisplayAttribute(int64_t display, int32_t config,
                                       DisplayAttribute attribute, int32_t* outValue) = 0;
 
+    virtual int32_t getDisplayCapabilities(int64_t display,
+                                           std::vector<DisplayCapability>* outCaps) = 0;
+    virtual int32_t getDisplayConfigs(int64_t display, std::vector<int32_t>* outConfigs) = 0;
+    virtual int32_t getActiveConfig(int64_t display, int32_t* outConfig) = 0;
     virtual int32_t getDisplayName(int64_t display, std::string* outName) = 0;
     virtual int32_t getDisplayVsyncPeriod(int64_t display, int32_t* outVsyncPeriod) = 0;
+    virtual int32_t setActiveConfig(int64_t display, int32_t config) = 0;
+    virtual int32_t setIdleTimerEnabled(int64_t display, int32_t timeout) = 0;
+    virtual int32_t setActiveConfigWithConstraints(
+            int64_t display, int32_t config, const VsyncPeriodChangeConstraints& constraints,
+            VsyncPeriodChangeTimeline* outTimeline) = 0;
     virtual int32_t presentDisplay(int64_t display, ndk::ScopedFileDescriptor& fence,
                                    std::vector<int64_t>* outLayers,
                                    std::vector<ndk::ScopedFileDescriptor>* outReleaseFences) = 0;
@@ -119,8 +134,30 @@ class IComposerHal {
                                     const ndk::ScopedFileDescriptor& fence,
                                     common::Dataspace dataspace,
                                     const std::vector<common::Rect>& damage) = 0; // cmd
+    virtual int32_t setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                                   const ndk::ScopedFileDescriptor& acquireFence) = 0; // cmd
+    virtual int32_t setLayerCursorPosition(int64_t display, int64_t layer, int32_t x,
+                                           int32_t y) = 0; // cmd
+    virtual int32_t setLayerBlendMode(int64_t display, int64_t layer,
+                                      common::BlendMode mode) = 0; // cmd
     virtual int32_t setLayerCompositionType(int64_t display, int64_t layer, Composition type) = 0;
+    virtual int32_t setLayerDataspace(int64_t display, int64_t layer,
+                                      common::Dataspace dataspace) = 0; // cmd
+    virtual int32_t setLayerDisplayFrame(int64_t display, int64_t layer,
+                                         const common::Rect& frame) = 0; // cmd
+    virtual int32_t setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) = 0; // cmd
+    virtual int32_t setLayerSourceCrop(int64_t display, int64_t layer,
+                                       const common::FRect& crop) = 0; // cmd
+    virtual int32_t setLayerSurfaceDamage(
+            int64_t display, int64_t layer,
+            const std::vector<std::optional<common::Rect>>& damage) = 0; // cmd
+    virtual int32_t setLayerTransform(int64_t display, int64_t layer,
+                                      common::Transform transform) = 0; // cmd
+    virtual int32_t setLayerZOrder(int64_t display, int64_t layer, uint32_t z) = 0; // cmd
     virtual int32_t setVsyncEnabled(int64_t display, bool enabled) = 0;
+    virtual int32_t setExpectedPresentTime(
+            int64_t display,
+            const std::optional<ClockMonotonicTimestamp> expectedPresentTime) = 0; // cmd
     virtual int32_t validateDisplay(int64_t display, std::vector<int64_t>* outChangedLayers,
                                     std::vector<Composition>* outCompositionTypes,
                                     uint32_t* outDisplayRequestMask,
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <functional>
+
 #include <aidlcommonsupport/NativeHandle.h>
 
 using AidlNativeHandle = aidl::android::hardware::common::NativeHandle;
@@ -37,6 +39,13 @@ public:
     virtual ~IResourceManager() = default;
     virtual std::unique_ptr<IBufferReleaser> createReleaser(bool isBuffer) = 0;
 
+    // Client targets and layer buffers: bufferKey() is asked about each
+    // buffer a slot takes in, while it is still valid, and its answer is
+    // passed to bufferReleased() once the cache lets go of the buffer.
+    using BufferKey = std::function<uint64_t(buffer_handle_t buffer)>;
+    using BufferReleased = std::function<void(uint64_t key)>;
+    virtual void setBufferListener(BufferKey bufferKey, BufferReleased bufferReleased) = 0;
+
     virtual void clear(RemoveDisplay removeDisplay) = 0;
     virtual bool hasDisplay(int64_t display) = 0;
     virtual int32_t addPhysicalDisplay(int64_t display) = 0;
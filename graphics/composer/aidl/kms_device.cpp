@@ -0,0 +1,262 @@
+/*
+ * Copyright 2023 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "composer-kms_device"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "kms_device.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+bool kms_prop::enum_value(const char *name, uint64_t *out) const
+{
+	for (const auto &e : enums) {
+		if (e.first == name) {
+			*out = e.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+const kms_prop *kms_object::prop(const char *name) const
+{
+	auto it = props.find(name);
+	return it == props.end() ? NULL : &it->second;
+}
+
+uint32_t kms_object::prop_id(const char *name) const
+{
+	const kms_prop *p = prop(name);
+	return p ? p->id : 0;
+}
+
+/*
+ * Planes share most properties, so each one is described by the
+ * driver only once per snapshot and its description reused.
+ */
+typedef std::unordered_map<uint32_t, std::pair<std::string, kms_prop>> prop_cache;
+
+static int read_props(int fd, uint32_t type, struct kms_object *obj,
+		prop_cache *cache)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, obj->id, type);
+	if (!props)
+		return -errno;
+
+	obj->props.clear();
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		auto it = cache->find(props->props[i]);
+		if (it == cache->end()) {
+			drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+			if (!prop)
+				continue;
+			struct kms_prop desc = {};
+			desc.id = prop->prop_id;
+			desc.flags = prop->flags;
+			if (prop->flags & (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_BITMASK)) {
+				for (int j = 0; j < prop->count_enums; j++)
+					desc.enums.emplace_back(prop->enums[j].name, prop->enums[j].value);
+			} else if (!(prop->flags & DRM_MODE_PROP_BLOB)) {
+				desc.values.assign(prop->values, prop->values + prop->count_values);
+			}
+			it = cache->emplace(props->props[i],
+					std::make_pair(std::string(prop->name), std::move(desc))).first;
+			drmModeFreeProperty(prop);
+		}
+		struct kms_prop p = it->second.second;
+		p.value = props->prop_values[i];
+		obj->props.emplace(it->second.first, std::move(p));
+	}
+	drmModeFreeObjectProperties(props);
+	return 0;
+}
+
+/*
+ * IN_FORMATS: a bitmask of formats per modifier, turned around into the
+ * modifiers of each format.
+ */
+static void read_in_formats(int fd, struct kms_plane_info *plane)
+{
+	const kms_prop *prop = plane->prop("IN_FORMATS");
+	if (!prop || !prop->value)
+		return;
+
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, (uint32_t)prop->value);
+	if (!blob)
+		return;
+
+	const char *data = (const char *)blob->data;
+	const struct drm_format_modifier_blob *header =
+			(const struct drm_format_modifier_blob *)data;
+	if (blob->length < sizeof(*header) || header->version != FORMAT_BLOB_CURRENT ||
+			header->formats_offset + header->count_formats * sizeof(uint32_t) >
+					blob->length ||
+			header->modifiers_offset + header->count_modifiers *
+					sizeof(struct drm_format_modifier) > blob->length) {
+		ALOGW("plane %u: bad IN_FORMATS blob", plane->id);
+		drmModeFreePropertyBlob(blob);
+		return;
+	}
+
+	const uint32_t *formats = (const uint32_t *)(data + header->formats_offset);
+	const struct drm_format_modifier *modifiers =
+			(const struct drm_format_modifier *)(data + header->modifiers_offset);
+	for (uint32_t m = 0; m < header->count_modifiers; m++) {
+		for (uint32_t bit = 0; bit < 64; bit++) {
+			uint32_t f = modifiers[m].offset + bit;
+			if ((modifiers[m].formats & (1ULL << bit)) && f < header->count_formats)
+				plane->modifiers[formats[f]].push_back(modifiers[m].modifier);
+		}
+	}
+	drmModeFreePropertyBlob(blob);
+}
+
+int kms_device::snapshot(int fd)
+{
+	drmModeResPtr resources = drmModeGetResources(fd);
+	if (!resources) {
+		ALOGE("failed to get modeset resources");
+		return -EINVAL;
+	}
+	drmModePlaneResPtr plane_resources = drmModeGetPlaneResources(fd);
+	if (!plane_resources) {
+		ALOGE("failed to get plane resources");
+		drmModeFreeResources(resources);
+		return -EINVAL;
+	}
+
+	prop_cache cache;
+	crtcs.clear();
+	planes.clear();
+	connectors.clear();
+	index.clear();
+
+	for (int i = 0; i < resources->count_crtcs; i++) {
+		drmModeCrtcPtr c = drmModeGetCrtc(fd, resources->crtcs[i]);
+		if (!c) {
+			ALOGW("drmModeGetCrtc(%u) failed", resources->crtcs[i]);
+			continue;
+		}
+		struct kms_crtc_info crtc = {};
+		crtc.id = c->crtc_id;
+		crtc.index = i;
+		crtc.mode_valid = c->mode_valid;
+		crtc.mode = c->mode;
+		crtc.buffer_id = c->buffer_id;
+		drmModeFreeCrtc(c);
+		if (read_props(fd, DRM_MODE_OBJECT_CRTC, &crtc, &cache))
+			continue;
+		index[crtc.id] = crtcs.size();
+		crtcs.push_back(std::move(crtc));
+	}
+
+	/* encoders only link connectors to crtcs, they aren't kept */
+	std::unordered_map<uint32_t, drmModeEncoder> encoders;
+	for (int i = 0; i < resources->count_encoders; i++) {
+		drmModeEncoderPtr e = drmModeGetEncoder(fd, resources->encoders[i]);
+		if (e) {
+			encoders[e->encoder_id] = *e;
+			drmModeFreeEncoder(e);
+		}
+	}
+
+	for (int i = 0; i < resources->count_connectors; i++) {
+		drmModeConnectorPtr c = drmModeGetConnector(fd, resources->connectors[i]);
+		if (!c) {
+			ALOGW("drmModeGetConnector(%u) failed", resources->connectors[i]);
+			continue;
+		}
+		struct kms_connector_info conn = {};
+		conn.id = c->connector_id;
+		conn.type = c->connector_type;
+		conn.type_id = c->connector_type_id;
+		conn.connection = c->connection;
+		conn.mm_width = c->mmWidth;
+		conn.mm_height = c->mmHeight;
+		conn.modes.assign(c->modes, c->modes + c->count_modes);
+		for (int j = 0; j < c->count_encoders; j++) {
+			auto e = encoders.find(c->encoders[j]);
+			if (e != encoders.end())
+				conn.possible_crtcs |= e->second.possible_crtcs;
+		}
+		auto e = encoders.find(c->encoder_id);
+		if (c->encoder_id && e != encoders.end())
+			conn.crtc_id = e->second.crtc_id;
+		drmModeFreeConnector(c);
+		if (read_props(fd, DRM_MODE_OBJECT_CONNECTOR, &conn, &cache))
+			continue;
+		index[conn.id] = connectors.size();
+		connectors.push_back(std::move(conn));
+	}
+
+	for (uint32_t i = 0; i < plane_resources->count_planes; i++) {
+		drmModePlanePtr p = drmModeGetPlane(fd, plane_resources->planes[i]);
+		if (!p) {
+			ALOGW("drmModeGetPlane(%u) failed", plane_resources->planes[i]);
+			continue;
+		}
+		struct kms_plane_info plane = {};
+		plane.id = p->plane_id;
+		plane.possible_crtcs = p->possible_crtcs;
+		plane.crtc_id = p->crtc_id;
+		plane.fb_id = p->fb_id;
+		plane.formats.assign(p->formats, p->formats + p->count_formats);
+		drmModeFreePlane(p);
+		if (read_props(fd, DRM_MODE_OBJECT_PLANE, &plane, &cache))
+			continue;
+		read_in_formats(fd, &plane);
+		index[plane.id] = planes.size();
+		planes.push_back(std::move(plane));
+	}
+
+	drmModeFreePlaneResources(plane_resources);
+	drmModeFreeResources(resources);
+
+	ALOGI("%zu crtcs, %zu planes, %zu connectors, %zu distinct properties",
+			crtcs.size(), planes.size(), connectors.size(), cache.size());
+	return 0;
+}
+
+const kms_crtc_info *kms_device::crtc(uint32_t id) const
+{
+	auto it = index.find(id);
+	if (it == index.end() || it->second >= crtcs.size() || crtcs[it->second].id != id)
+		return NULL;
+	return &crtcs[it->second];
+}
+
+const kms_plane_info *kms_device::plane(uint32_t id) const
+{
+	auto it = index.find(id);
+	if (it == index.end() || it->second >= planes.size() || planes[it->second].id != id)
+		return NULL;
+	return &planes[it->second];
+}
+
+const kms_connector_info *kms_device::connector(uint32_t id) const
+{
+	auto it = index.find(id);
+	if (it == index.end() || it->second >= connectors.size() ||
+			connectors[it->second].id != id)
+		return NULL;
+	return &connectors[it->second];
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2023 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+struct kms_prop
+{
+    uint32_t id;
+    uint32_t flags;             /* DRM_MODE_PROP_* */
+    uint64_t value;             /* when the snapshot was taken */
+    std::vector<uint64_t> values;   /* min and max of a range */
+    std::vector<std::pair<std::string, uint64_t>> enums;   /* enum and bitmask entries */
+
+    /* false if the driver has no entry called name */
+    bool enum_value(const char *name, uint64_t *out) const;
+};
+
+struct kms_object
+{
+    uint32_t id;
+    std::unordered_map<std::string, kms_prop> props;
+
+    /* NULL if the object has no such property */
+    const kms_prop *prop(const char *name) const;
+    /* 0 if the object has no such property */
+    uint32_t prop_id(const char *name) const;
+};
+
+struct kms_crtc_info : kms_object
+{
+    uint32_t index;             /* the pipe, its bit in possible_crtcs */
+    bool mode_valid;
+    drmModeModeInfo mode;       /* on screen, e.g. set by the bootloader */
+    uint32_t buffer_id;
+};
+
+struct kms_plane_info : kms_object
+{
+    uint32_t possible_crtcs;
+    uint32_t crtc_id;           /* showing fb_id there, 0 if off */
+    uint32_t fb_id;
+    std::vector<uint32_t> formats;
+    /* per format from IN_FORMATS, empty without that property */
+    std::unordered_map<uint32_t, std::vector<uint64_t>> modifiers;
+};
+
+struct kms_connector_info : kms_object
+{
+    uint32_t type;              /* DRM_MODE_CONNECTOR_* */
+    uint32_t type_id;
+    int connection;             /* drmModeConnection */
+    uint32_t mm_width, mm_height;
+    std::vector<drmModeModeInfo> modes;
+    uint32_t possible_crtcs;    /* through any of its encoders */
+    uint32_t crtc_id;           /* driving it, 0 if none */
+};
+
+/*
+ * Every CRTC, plane and connector of a device with all of their
+ * properties, read once at init and again on hotplug. Lookups after
+ * that are hash lookups, no ioctls.
+ */
+class kms_device {
+  public :
+    int snapshot(int fd);
+
+    const kms_crtc_info *crtc(uint32_t id) const;
+    const kms_plane_info *plane(uint32_t id) const;
+    const kms_connector_info *connector(uint32_t id) const;
+
+    std::vector<kms_crtc_info> crtcs;   /* in pipe order */
+    std::vector<kms_plane_info> planes;
+    std::vector<kms_connector_info> connectors;
+
+  private:
+    /* object ids are unique across types, the index is into the vector of the type */
+    std::unordered_map<uint32_t, size_t> index;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
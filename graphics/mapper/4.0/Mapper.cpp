@@ -22,8 +22,15 @@
 #include <cutils/properties.h>
 #include <gralloctypes/Gralloc4.h>
 #include <hardware/gralloc1.h>
+#include <drm_fourcc.h>
+
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include <drm_gralloc.h>
+#include <drm_mapper.h>
 #include "Mapper.h"
 
 namespace android {
@@ -33,7 +40,11 @@ namespace mapper {
 namespace V4_0 {
 namespace implementation {
 
+using aidl::android::hardware::graphics::common::BlendMode;
+using aidl::android::hardware::graphics::common::Cta861_3;
 using aidl::android::hardware::graphics::common::Dataspace;
+using aidl::android::hardware::graphics::common::PlaneLayout;
+using aidl::android::hardware::graphics::common::Smpte2086;
 using aidl::android::hardware::graphics::common::StandardMetadataType;
 
 Mapper::Mapper() {
@@ -136,24 +147,18 @@ Return<Error> Mapper::freeBuffer(void* buffer) {
 }
 
 
-static Error getFenceFd(const hidl_handle& fenceHandle, base::unique_fd* outFenceFd) {
+// The fence fd stays owned by fenceHandle, which outlives the lock() call.
+static Error getFenceFd(const hidl_handle& fenceHandle, int* outFenceFd) {
     auto handle = fenceHandle.getNativeHandle();
     if (handle && handle->numFds > 1) {
         ALOGE("invalid fence handle with %d fds", handle->numFds);
         return Error::BAD_VALUE;
     }
-    int fenceFd = (handle && handle->numFds == 1) ? handle->data[0] : -1;
-    if (fenceFd >= 0) {
-        fenceFd = dup(fenceFd);
-        if (fenceFd < 0) {
-            return Error::NO_RESOURCES;
-        }
-    }
-    outFenceFd->reset(fenceFd);
+    *outFenceFd = (handle && handle->numFds == 1) ? handle->data[0] : -1;
     return Error::NONE;
 }
 
-Return<void> Mapper::lock(void* buffer, uint64_t /*cpuUsage*/, const IMapper::Rect& /*accessRegion*/,
+Return<void> Mapper::lock(void* buffer, uint64_t cpuUsage, const IMapper::Rect& accessRegion,
                   const hidl_handle& acquireFence, IMapper::lock_cb hidl_cb) {
     const native_handle_t* bufferHandle = static_cast<const native_handle_t*>(buffer);
     if (!bufferHandle) {
@@ -161,21 +166,25 @@ Return<void> Mapper::lock(void* buffer, uint64_t /*cpuUsage*/, const IMapper::Re
         return Void();
     }
 
-    base::unique_fd fenceFd;
+    int fenceFd;
     Error error = getFenceFd(acquireFence, &fenceFd);
     if (error != Error::NONE) {
         hidl_cb(error, nullptr);
         return Void();
     }
-    sp<Fence> aFence{new Fence(fenceFd.release())};
-    aFence->waitForever("Mapper::lock");
+    int result = drm_wait_fence(fenceFd, "Mapper::lock");
+    if (result != 0) {
+        ALOGW("drm_wait_fence() returned %d", result);
+    }
 
     void* data = nullptr;
-    int result = drm_lock(bufferHandle, &data);
+    const struct drm_lock_rect region = { accessRegion.left, accessRegion.top,
+            accessRegion.width, accessRegion.height };
+    result = drm_lock(bufferHandle, cpuUsage, &region, &data);
 
     if (result != 0) {
     	ALOGE("drm_lock() returned %d", result);
-        hidl_cb(Error::UNSUPPORTED, nullptr);
+        hidl_cb(Error::BAD_VALUE, nullptr);
     } else {
         hidl_cb(error, data);
     }
@@ -201,7 +210,7 @@ Return<void> Mapper::unlock(void* buffer, IMapper::unlock_cb hidl_cb) {
     int result = drm_unlock(bufferHandle);
 	if (result != 0) {
 		ALOGE("Mapper unlock failed: %d", result);
-        hidl_cb(Error::UNSUPPORTED, nullptr);
+        hidl_cb(Error::BAD_BUFFER, nullptr);
         return Void();
 	}
 
@@ -237,10 +246,10 @@ Return<void> Mapper::flushLockedBuffer(void* buffer,flushLockedBuffer_cb hidl_cb
         return Void();
     }
 
-    int result = drm_unlock(bufferHandle);
+    int result = drm_flush(bufferHandle);
 	if (result != 0) {
-		ALOGE("Mapper unlock failed: %d", result);
-        hidl_cb(Error::UNSUPPORTED, nullptr);
+		ALOGE("Mapper flush failed: %d", result);
+        hidl_cb(Error::BAD_BUFFER, nullptr);
         return Void();
 	}
 
@@ -261,10 +270,13 @@ Return<Error> Mapper::rereadLockedBuffer(void* buffer) {
     return Error::NONE;
 }
 
-Return<void> Mapper::isSupported(const BufferDescriptorInfo& /*descriptor*/,
+Return<void> Mapper::isSupported(const BufferDescriptorInfo& descriptor,
         isSupported_cb hidl_cb) {
     ALOGV("isSupported()");
-    hidl_cb(Error::NONE, true);
+    // what the allocator accepts, see Allocator::isSupported()
+    hidl_cb(Error::NONE, descriptor.width > 0 && descriptor.height > 0 &&
+            descriptor.layerCount == 1 && descriptor.reservedSize == 0 &&
+            drm_format_supported(static_cast<int>(descriptor.format)));
     return Void();
 }
 
@@ -272,29 +284,210 @@ Return<void> Mapper::get(void* buffer, const MetadataType& metadataType, get_cb
     ALOGV("get()");
     hidl_vec<uint8_t> encodedMetadata;
     buffer_handle_t bufferHandle = reinterpret_cast<buffer_handle_t>(buffer);
-    if (!bufferHandle) {
+    struct drm_metadata* meta = drm_get_metadata(bufferHandle);
+    if (!meta) {
         hidl_cb(Error::BAD_BUFFER, encodedMetadata);
         return Void();
     }
-    if (android::gralloc4::isStandardMetadataType(metadataType) &&
-	android::gralloc4::getStandardMetadataTypeValue(metadataType)
-	    == StandardMetadataType::DATASPACE) {
-	    android::gralloc4::encodeDataspace(Dataspace::UNKNOWN, &encodedMetadata);
-      hidl_cb(Error::NONE, encodedMetadata);
-    } else {
-      hidl_cb(Error::UNSUPPORTED, encodedMetadata);
+    if (!android::gralloc4::isStandardMetadataType(metadataType)) {
+        hidl_cb(Error::UNSUPPORTED, encodedMetadata);
+        return Void();
+    }
+
+    const private_handle_t* hnd = reinterpret_cast<const private_handle_t*>(bufferHandle);
+    struct drm_metadata_state state;
+    if (drm_metadata_read(meta, &state) != 0) {
+        hidl_cb(Error::NO_RESOURCES, encodedMetadata);
+        return Void();
+    }
+
+    int ret = 0;
+    switch (android::gralloc4::getStandardMetadataTypeValue(metadataType)) {
+    case StandardMetadataType::BUFFER_ID:
+        ret = android::gralloc4::encodeBufferId(meta->buffer_id, &encodedMetadata);
+        break;
+    case StandardMetadataType::NAME:
+        ret = android::gralloc4::encodeName(std::string(meta->name, strnlen(meta->name,
+                sizeof(meta->name))), &encodedMetadata);
+        break;
+    case StandardMetadataType::WIDTH:
+        ret = android::gralloc4::encodeWidth(hnd->width, &encodedMetadata);
+        break;
+    case StandardMetadataType::HEIGHT:
+        ret = android::gralloc4::encodeHeight(hnd->height, &encodedMetadata);
+        break;
+    case StandardMetadataType::LAYER_COUNT:
+        ret = android::gralloc4::encodeLayerCount(1, &encodedMetadata);
+        break;
+    case StandardMetadataType::PIXEL_FORMAT_REQUESTED:
+        ret = android::gralloc4::encodePixelFormatRequested(
+                static_cast<PixelFormat>(hnd->format), &encodedMetadata);
+        break;
+    case StandardMetadataType::PIXEL_FORMAT_FOURCC:
+        ret = android::gralloc4::encodePixelFormatFourCC(drm_format_fourcc(hnd->format),
+                &encodedMetadata);
+        break;
+    case StandardMetadataType::PIXEL_FORMAT_MODIFIER:
+        ret = android::gralloc4::encodePixelFormatModifier(DRM_FORMAT_MOD_LINEAR,
+                &encodedMetadata);
+        break;
+    case StandardMetadataType::USAGE:
+        ret = android::gralloc4::encodeUsage(meta->usage, &encodedMetadata);
+        break;
+    case StandardMetadataType::ALLOCATION_SIZE:
+        ret = android::gralloc4::encodeAllocationSize(hnd->size, &encodedMetadata);
+        break;
+    case StandardMetadataType::PROTECTED_CONTENT:
+        ret = android::gralloc4::encodeProtectedContent(
+                (meta->usage & BufferUsage::PROTECTED) ? 1 : 0, &encodedMetadata);
+        break;
+    case StandardMetadataType::COMPRESSION:
+        ret = android::gralloc4::encodeCompression(android::gralloc4::Compression_None,
+                &encodedMetadata);
+        break;
+    case StandardMetadataType::INTERLACED:
+        ret = android::gralloc4::encodeInterlaced(android::gralloc4::Interlaced_None,
+                &encodedMetadata);
+        break;
+    case StandardMetadataType::CHROMA_SITING:
+        ret = android::gralloc4::encodeChromaSiting(android::gralloc4::ChromaSiting_None,
+                &encodedMetadata);
+        break;
+    case StandardMetadataType::PLANE_LAYOUTS: {
+        std::optional<PlaneLayout> layout = drm_plane_layout(hnd);
+        if (!layout) {
+            hidl_cb(Error::UNSUPPORTED, encodedMetadata);
+            return Void();
+        }
+        ret = android::gralloc4::encodePlaneLayouts({*layout}, &encodedMetadata);
+        break;
+    }
+    case StandardMetadataType::CROP: {
+        // IMapper::Rect would shadow the aidl one here
+        aidl::android::hardware::graphics::common::Rect crop = { 0, 0, hnd->width, hnd->height };
+        ret = android::gralloc4::encodeCrop({crop}, &encodedMetadata);
+        break;
+    }
+    case StandardMetadataType::DATASPACE:
+        ret = android::gralloc4::encodeDataspace(static_cast<Dataspace>(state.dataspace),
+                &encodedMetadata);
+        break;
+    case StandardMetadataType::BLEND_MODE:
+        ret = android::gralloc4::encodeBlendMode(static_cast<BlendMode>(state.blend_mode),
+                &encodedMetadata);
+        break;
+    case StandardMetadataType::SMPTE2086: {
+        std::optional<Smpte2086> smpte2086;
+        if (state.flags & DRM_METADATA_HAS_SMPTE2086) {
+            const struct drm_smpte2086& s = state.smpte2086;
+            smpte2086 = Smpte2086{
+                    { s.primary_red.x, s.primary_red.y },
+                    { s.primary_green.x, s.primary_green.y },
+                    { s.primary_blue.x, s.primary_blue.y },
+                    { s.white_point.x, s.white_point.y },
+                    s.max_luminance, s.min_luminance };
+        }
+        ret = android::gralloc4::encodeSmpte2086(smpte2086, &encodedMetadata);
+        break;
+    }
+    case StandardMetadataType::CTA861_3: {
+        std::optional<Cta861_3> cta861_3;
+        if (state.flags & DRM_METADATA_HAS_CTA861_3) {
+            cta861_3 = Cta861_3{ state.cta861_3.max_content_light_level,
+                    state.cta861_3.max_frame_average_light_level };
+        }
+        ret = android::gralloc4::encodeCta861_3(cta861_3, &encodedMetadata);
+        break;
+    }
+    case StandardMetadataType::SMPTE2094_40: {
+        std::optional<std::vector<uint8_t>> smpte2094_40;
+        if (state.flags & DRM_METADATA_HAS_SMPTE2094_40) {
+            smpte2094_40 = std::vector<uint8_t>(state.smpte2094_40,
+                    state.smpte2094_40 + state.smpte2094_40_size);
+        }
+        ret = android::gralloc4::encodeSmpte2094_40(smpte2094_40, &encodedMetadata);
+        break;
+    }
+    default:
+        hidl_cb(Error::UNSUPPORTED, encodedMetadata);
+        return Void();
+    }
+
+    if (ret) {
+        ALOGE("failed to encode metadata: %d", ret);
+        hidl_cb(Error::NO_RESOURCES, encodedMetadata);
+        return Void();
     }
+    hidl_cb(Error::NONE, encodedMetadata);
     return Void();
 }
 
-Return<Error> Mapper::set(void* buffer, const MetadataType& /*metadataType*/,
-        const hidl_vec<uint8_t>& /*metadata*/) {
+Return<Error> Mapper::set(void* buffer, const MetadataType& metadataType,
+        const hidl_vec<uint8_t>& metadata) {
     ALOGV("set()");
     buffer_handle_t bufferHandle = reinterpret_cast<buffer_handle_t>(buffer);
-    if (!bufferHandle) {
+    struct drm_metadata* meta = drm_get_metadata(bufferHandle);
+    if (!meta) {
         return Error::BAD_BUFFER;
     }
-    return Error::UNSUPPORTED;
+    if (!android::gralloc4::isStandardMetadataType(metadataType)) {
+        return Error::UNSUPPORTED;
+    }
+
+    int ret;
+    int written = 0;
+    switch (android::gralloc4::getStandardMetadataTypeValue(metadataType)) {
+    case StandardMetadataType::DATASPACE: {
+        Dataspace dataspace;
+        ret = android::gralloc4::decodeDataspace(metadata, &dataspace);
+        if (!ret)
+            written = drm_metadata_set(meta, dataspace);
+        break;
+    }
+    case StandardMetadataType::BLEND_MODE: {
+        BlendMode blendMode;
+        ret = android::gralloc4::decodeBlendMode(metadata, &blendMode);
+        if (!ret)
+            written = drm_metadata_set(meta, blendMode);
+        break;
+    }
+    case StandardMetadataType::SMPTE2086: {
+        std::optional<Smpte2086> smpte2086;
+        ret = android::gralloc4::decodeSmpte2086(metadata, &smpte2086);
+        if (!ret)
+            written = drm_metadata_set(meta, smpte2086);
+        break;
+    }
+    case StandardMetadataType::CTA861_3: {
+        std::optional<Cta861_3> cta861_3;
+        ret = android::gralloc4::decodeCta861_3(metadata, &cta861_3);
+        if (!ret)
+            written = drm_metadata_set(meta, cta861_3);
+        break;
+    }
+    case StandardMetadataType::SMPTE2094_40: {
+        std::optional<std::vector<uint8_t>> smpte2094_40;
+        ret = android::gralloc4::decodeSmpte2094_40(metadata, &smpte2094_40);
+        if (!ret)
+            written = drm_metadata_set(meta, smpte2094_40);
+        break;
+    }
+    default:
+        return Error::UNSUPPORTED;
+    }
+
+    if (ret) {
+        ALOGE("failed to decode metadata: %d", ret);
+        return Error::BAD_VALUE;
+    }
+    if (written == -EINVAL) {
+        return Error::BAD_VALUE;
+    }
+    if (written) {
+        ALOGE("metadata of buffer %p is locked by another writer", bufferHandle);
+        return Error::NO_RESOURCES;
+    }
+    return Error::NONE;
 }
 
 Return<void> Mapper::getFromBufferDescriptorInfo(const BufferDescriptorInfo& /*descriptor*/,
@@ -307,21 +500,118 @@ Return<void> Mapper::getFromBufferDescriptorInfo(const BufferDescriptorInfo& /*d
 
 Return<void> Mapper::listSupportedMetadataTypes(listSupportedMetadataTypes_cb hidl_cb) {
     ALOGV("listSupportedMetadataTypes()");
-    hidl_vec<MetadataTypeDescription> supported;
+    const struct {
+        const MetadataType& type;
+        bool isSettable;
+    } types[] = {
+        { android::gralloc4::MetadataType_BufferId, false },
+        { android::gralloc4::MetadataType_Name, false },
+        { android::gralloc4::MetadataType_Width, false },
+        { android::gralloc4::MetadataType_Height, false },
+        { android::gralloc4::MetadataType_LayerCount, false },
+        { android::gralloc4::MetadataType_PixelFormatRequested, false },
+        { android::gralloc4::MetadataType_PixelFormatFourCC, false },
+        { android::gralloc4::MetadataType_PixelFormatModifier, false },
+        { android::gralloc4::MetadataType_Usage, false },
+        { android::gralloc4::MetadataType_AllocationSize, false },
+        { android::gralloc4::MetadataType_ProtectedContent, false },
+        { android::gralloc4::MetadataType_Compression, false },
+        { android::gralloc4::MetadataType_Interlaced, false },
+        { android::gralloc4::MetadataType_ChromaSiting, false },
+        { android::gralloc4::MetadataType_PlaneLayouts, false },
+        { android::gralloc4::MetadataType_Crop, false },
+        { android::gralloc4::MetadataType_Dataspace, true },
+        { android::gralloc4::MetadataType_BlendMode, true },
+        { android::gralloc4::MetadataType_Smpte2086, true },
+        { android::gralloc4::MetadataType_Cta861_3, true },
+        { android::gralloc4::MetadataType_Smpte2094_40, true },
+    };
+
+    hidl_vec<MetadataTypeDescription> supported(std::size(types));
+    for (size_t i = 0; i < std::size(types); i++) {
+        supported[i].metadataType = types[i].type;
+        supported[i].description = "";
+        supported[i].isGettable = true;
+        supported[i].isSettable = types[i].isSettable;
+    }
     hidl_cb(Error::NONE, supported);
     return Void();
 }
 
-Return<void> Mapper::dumpBuffer(void* /*buffer*/, dumpBuffer_cb hidl_cb) {
+static void dumpMetadata(const IMapper::MetadataType& type, hidl_vec<uint8_t>&& metadata,
+        std::vector<IMapper::MetadataDump>* dumps) {
+    IMapper::MetadataDump dump;
+    dump.metadataType = type;
+    dump.metadata = std::move(metadata);
+    dumps->push_back(std::move(dump));
+}
+
+static void dumpRegistryMetadata(int64_t type, uint64_t value,
+        std::vector<IMapper::MetadataDump>* dumps) {
+    IMapper::MetadataType metadataType;
+    metadataType.name = DRM_REGISTRY_METADATA_TYPE;
+    metadataType.value = type;
+    // same little endian int64 layout gralloc4 uses for its own integers
+    hidl_vec<uint8_t> metadata(sizeof(value));
+    memcpy(metadata.data(), &value, sizeof(value));
+    dumpMetadata(metadataType, std::move(metadata), dumps);
+}
+
+static IMapper::BufferDump dumpBufferInfo(const struct drm_buffer_info& info) {
+    std::vector<IMapper::MetadataDump> dumps;
+    hidl_vec<uint8_t> metadata;
+
+    if (!android::gralloc4::encodeBufferId(info.buffer_id, &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_BufferId, std::move(metadata), &dumps);
+    if (!android::gralloc4::encodeName(info.name, &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_Name, std::move(metadata), &dumps);
+    if (!android::gralloc4::encodeWidth(info.width, &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_Width, std::move(metadata), &dumps);
+    if (!android::gralloc4::encodeHeight(info.height, &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_Height, std::move(metadata), &dumps);
+    if (!android::gralloc4::encodePixelFormatRequested(static_cast<PixelFormat>(info.format),
+            &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_PixelFormatRequested, std::move(metadata),
+                &dumps);
+    if (!android::gralloc4::encodeUsage(info.usage, &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_Usage, std::move(metadata), &dumps);
+    if (!android::gralloc4::encodeAllocationSize(info.size, &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_AllocationSize, std::move(metadata), &dumps);
+    if (!android::gralloc4::encodeDataspace(static_cast<Dataspace>(info.dataspace), &metadata))
+        dumpMetadata(android::gralloc4::MetadataType_Dataspace, std::move(metadata), &dumps);
+
+    dumpRegistryMetadata(DRM_REGISTRY_IMPORT_COUNT, info.import_count, &dumps);
+    dumpRegistryMetadata(DRM_REGISTRY_MAPPED, info.mapped, &dumps);
+    dumpRegistryMetadata(DRM_REGISTRY_LOCK_COUNT, info.lock_count, &dumps);
+
+    IMapper::BufferDump bufferDump;
+    bufferDump.metadataDump = dumps;
+    return bufferDump;
+}
+
+Return<void> Mapper::dumpBuffer(void* buffer, dumpBuffer_cb hidl_cb) {
     ALOGV("dumpBuffer()");
     BufferDump bufferDump;
-    hidl_cb(Error::NONE, bufferDump);
+    buffer_handle_t bufferHandle = reinterpret_cast<buffer_handle_t>(buffer);
+    struct drm_buffer_info info;
+    if (drm_get_buffer_info(bufferHandle, &info) != 0) {
+        hidl_cb(Error::BAD_BUFFER, bufferDump);
+        return Void();
+    }
+    hidl_cb(Error::NONE, dumpBufferInfo(info));
     return Void();
 }
 
 Return<void> Mapper::dumpBuffers(dumpBuffers_cb hidl_cb) {
     ALOGV("dumpBuffers()");
+    std::vector<struct drm_buffer_info> infos;
+    drm_get_buffer_infos(&infos);
+
     std::vector<BufferDump> bufferDumps;
+    bufferDumps.reserve(infos.size());
+    for (const auto& info : infos) {
+        bufferDumps.push_back(dumpBufferInfo(info));
+    }
     hidl_cb(Error::NONE, bufferDumps);
     return Void();
 }
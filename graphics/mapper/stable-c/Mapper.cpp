@@ -0,0 +1,482 @@
+/*
+ * Copyright 2023 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "mapper.arv"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <android-base/unique_fd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/native_handle.h>
+#include <cutils/properties.h>
+#include <gralloctypes/Gralloc4.h>
+#include <hardware/gralloc.h>
+#include <drm_fourcc.h>
+
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <drm_gralloc.h>
+#include <drm_mapper.h>
+#include "Mapper.h"
+
+using namespace ::android::hardware::graphics::mapper;
+using aidl::android::hardware::graphics::common::BlendMode;
+using aidl::android::hardware::graphics::common::BufferUsage;
+using aidl::android::hardware::graphics::common::Cta861_3;
+using aidl::android::hardware::graphics::common::Dataspace;
+using aidl::android::hardware::graphics::common::PixelFormat;
+using aidl::android::hardware::graphics::common::PlaneLayout;
+using aidl::android::hardware::graphics::common::Rect;
+using aidl::android::hardware::graphics::common::Smpte2086;
+using aidl::android::hardware::graphics::common::StandardMetadataType;
+
+static const char kStandardMetadataTypeName[] =
+        "android.hardware.graphics.common.StandardMetadataType";
+
+namespace arpi::mapper {
+
+Mapper::Mapper() {
+    ALOGV("Mapper()");
+    char path[PROPERTY_VALUE_MAX];
+    property_get("gralloc.drm.kms", path, "/dev/dri/card0");
+
+    kms_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (kms_fd < 0) {
+        ALOGE("failed to open %s", path);
+    }
+}
+
+Mapper::~Mapper() {
+    ALOGV("~Mapper()");
+    if (kms_fd >= 0) {
+        close(kms_fd);
+    }
+}
+
+AIMapper_Error Mapper::importBuffer(const native_handle_t* _Nonnull handle,
+        buffer_handle_t _Nullable* _Nonnull outBufferHandle) {
+    if (!handle) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    native_handle_t* bufferHandle = native_handle_clone(handle);
+    if (!bufferHandle) {
+        return AIMAPPER_ERROR_NO_RESOURCES;
+    }
+
+    ALOGV("register(%p)", bufferHandle);
+    int result = drm_register(kms_fd, bufferHandle);
+    if (result != 0) {
+        ALOGE("register failed: %d", result);
+        native_handle_close(bufferHandle);
+        native_handle_delete(bufferHandle);
+        return AIMAPPER_ERROR_NO_RESOURCES;
+    }
+    *outBufferHandle = bufferHandle;
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::freeBuffer(buffer_handle_t _Nonnull buffer) {
+    if (private_handle_t::validate(buffer) < 0) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    ALOGV("unregister(%p)", buffer);
+    drm_free(kms_fd, buffer);
+    native_handle_close(buffer);
+    native_handle_delete(const_cast<native_handle_t*>(buffer));
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::getTransportSize(buffer_handle_t _Nonnull buffer,
+        uint32_t* _Nonnull outNumFds, uint32_t* _Nonnull outNumInts) {
+    if (private_handle_t::validate(buffer) < 0) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    *outNumFds = buffer->numFds;
+    *outNumInts = buffer->numInts;
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::lock(buffer_handle_t _Nonnull buffer, uint64_t cpuUsage,
+        ARect accessRegion, int acquireFence, void* _Nullable* _Nonnull outData) {
+    // the acquire fence is ours to close, also on error
+    android::base::unique_fd fence(acquireFence);
+    if (private_handle_t::validate(buffer) < 0) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+
+    int result = drm_wait_fence(fence.get(), "AIMapper::lock");
+    if (result != 0) {
+        ALOGW("drm_wait_fence() returned %d", result);
+    }
+
+    const struct drm_lock_rect region = { accessRegion.left, accessRegion.top,
+            accessRegion.right - accessRegion.left, accessRegion.bottom - accessRegion.top };
+    result = drm_lock(buffer, cpuUsage, &region, outData);
+    if (result != 0) {
+        ALOGE("drm_lock() returned %d", result);
+        return AIMAPPER_ERROR_BAD_VALUE;
+    }
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::unlock(buffer_handle_t _Nonnull buffer, int* _Nonnull releaseFence) {
+    int result = drm_unlock(buffer);
+    if (result != 0) {
+        ALOGE("Mapper unlock failed: %d", result);
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    // CPU access is synchronous, nothing to wait for
+    *releaseFence = -1;
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::flushLockedBuffer(buffer_handle_t _Nonnull buffer) {
+    int result = drm_flush(buffer);
+    if (result != 0) {
+        ALOGE("Mapper flush failed: %d", result);
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::rereadLockedBuffer(buffer_handle_t _Nonnull buffer) {
+    if (private_handle_t::validate(buffer) < 0) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    return AIMAPPER_ERROR_NONE;
+}
+
+template <StandardMetadataType T>
+static int32_t provideMetadata(const private_handle_t* hnd, const struct drm_metadata* meta,
+        const struct drm_metadata_state& state, auto&& provide) {
+    if constexpr (T == StandardMetadataType::BUFFER_ID) {
+        return provide(meta->buffer_id);
+    }
+    if constexpr (T == StandardMetadataType::NAME) {
+        return provide(std::string(meta->name, strnlen(meta->name, sizeof(meta->name))));
+    }
+    if constexpr (T == StandardMetadataType::WIDTH) {
+        return provide(static_cast<uint64_t>(hnd->width));
+    }
+    if constexpr (T == StandardMetadataType::HEIGHT) {
+        return provide(static_cast<uint64_t>(hnd->height));
+    }
+    if constexpr (T == StandardMetadataType::LAYER_COUNT) {
+        return provide(static_cast<uint64_t>(1));
+    }
+    if constexpr (T == StandardMetadataType::PIXEL_FORMAT_REQUESTED) {
+        return provide(static_cast<PixelFormat>(hnd->format));
+    }
+    if constexpr (T == StandardMetadataType::PIXEL_FORMAT_FOURCC) {
+        return provide(drm_format_fourcc(hnd->format));
+    }
+    if constexpr (T == StandardMetadataType::PIXEL_FORMAT_MODIFIER) {
+        return provide(static_cast<uint64_t>(DRM_FORMAT_MOD_LINEAR));
+    }
+    if constexpr (T == StandardMetadataType::USAGE) {
+        return provide(static_cast<BufferUsage>(meta->usage));
+    }
+    if constexpr (T == StandardMetadataType::ALLOCATION_SIZE) {
+        return provide(static_cast<uint64_t>(hnd->size));
+    }
+    if constexpr (T == StandardMetadataType::PROTECTED_CONTENT) {
+        return provide(static_cast<uint64_t>(
+                (meta->usage & static_cast<uint64_t>(BufferUsage::PROTECTED)) ? 1 : 0));
+    }
+    if constexpr (T == StandardMetadataType::COMPRESSION) {
+        return provide(android::gralloc4::Compression_None);
+    }
+    if constexpr (T == StandardMetadataType::INTERLACED) {
+        return provide(android::gralloc4::Interlaced_None);
+    }
+    if constexpr (T == StandardMetadataType::CHROMA_SITING) {
+        return provide(android::gralloc4::ChromaSiting_None);
+    }
+    if constexpr (T == StandardMetadataType::PLANE_LAYOUTS) {
+        std::optional<PlaneLayout> layout = drm_plane_layout(hnd);
+        if (!layout) {
+            return -AIMAPPER_ERROR_UNSUPPORTED;
+        }
+        return provide(std::vector<PlaneLayout>{*layout});
+    }
+    if constexpr (T == StandardMetadataType::CROP) {
+        return provide(std::vector<Rect>{Rect{0, 0, hnd->width, hnd->height}});
+    }
+    if constexpr (T == StandardMetadataType::DATASPACE) {
+        return provide(static_cast<Dataspace>(state.dataspace));
+    }
+    if constexpr (T == StandardMetadataType::BLEND_MODE) {
+        return provide(static_cast<BlendMode>(state.blend_mode));
+    }
+    if constexpr (T == StandardMetadataType::SMPTE2086) {
+        std::optional<Smpte2086> smpte2086;
+        if (state.flags & DRM_METADATA_HAS_SMPTE2086) {
+            const struct drm_smpte2086& s = state.smpte2086;
+            smpte2086 = Smpte2086{
+                    { s.primary_red.x, s.primary_red.y },
+                    { s.primary_green.x, s.primary_green.y },
+                    { s.primary_blue.x, s.primary_blue.y },
+                    { s.white_point.x, s.white_point.y },
+                    s.max_luminance, s.min_luminance };
+        }
+        return provide(smpte2086);
+    }
+    if constexpr (T == StandardMetadataType::CTA861_3) {
+        std::optional<Cta861_3> cta861_3;
+        if (state.flags & DRM_METADATA_HAS_CTA861_3) {
+            cta861_3 = Cta861_3{ state.cta861_3.max_content_light_level,
+                    state.cta861_3.max_frame_average_light_level };
+        }
+        return provide(cta861_3);
+    }
+    if constexpr (T == StandardMetadataType::SMPTE2094_40) {
+        std::optional<std::vector<uint8_t>> smpte2094_40;
+        if (state.flags & DRM_METADATA_HAS_SMPTE2094_40) {
+            smpte2094_40 = std::vector<uint8_t>(state.smpte2094_40,
+                    state.smpte2094_40 + state.smpte2094_40_size);
+        }
+        return provide(smpte2094_40);
+    }
+    if constexpr (T == StandardMetadataType::STRIDE) {
+        return provide(static_cast<int32_t>(hnd->stride));
+    }
+    return -AIMAPPER_ERROR_UNSUPPORTED;
+}
+
+int32_t Mapper::getMetadata(buffer_handle_t _Nonnull buffer, AIMapper_MetadataType metadataType,
+        void* _Nullable outData, size_t outDataSize) {
+    if (strcmp(metadataType.name, kStandardMetadataTypeName)) {
+        return -AIMAPPER_ERROR_UNSUPPORTED;
+    }
+    return getStandardMetadata(buffer, metadataType.value, outData, outDataSize);
+}
+
+int32_t Mapper::getStandardMetadata(buffer_handle_t _Nonnull buffer,
+        int64_t standardMetadataType, void* _Nullable outData, size_t outDataSize) {
+    struct drm_metadata* meta = drm_get_metadata(buffer);
+    if (!meta) {
+        return -AIMAPPER_ERROR_BAD_BUFFER;
+    }
+
+    const private_handle_t* hnd = reinterpret_cast<const private_handle_t*>(buffer);
+    struct drm_metadata_state state;
+    if (drm_metadata_read(meta, &state) != 0) {
+        return -AIMAPPER_ERROR_NO_RESOURCES;
+    }
+
+    auto provider = [&]<StandardMetadataType T>(auto&& provide) -> int32_t {
+        return provideMetadata<T>(hnd, meta, state, provide);
+    };
+    return provideStandardMetadata(static_cast<StandardMetadataType>(standardMetadataType),
+            outData, outDataSize, provider);
+}
+
+AIMapper_Error Mapper::setMetadata(buffer_handle_t _Nonnull buffer,
+        AIMapper_MetadataType metadataType, const void* _Nonnull metadata,
+        size_t metadataSize) {
+    if (strcmp(metadataType.name, kStandardMetadataTypeName)) {
+        return AIMAPPER_ERROR_UNSUPPORTED;
+    }
+    return setStandardMetadata(buffer, metadataType.value, metadata, metadataSize);
+}
+
+template <StandardMetadataType T>
+static AIMapper_Error applyMetadata(struct drm_metadata* meta, auto&& value) {
+    if constexpr (T == StandardMetadataType::DATASPACE ||
+            T == StandardMetadataType::BLEND_MODE ||
+            T == StandardMetadataType::SMPTE2086 ||
+            T == StandardMetadataType::CTA861_3 ||
+            T == StandardMetadataType::SMPTE2094_40) {
+        int err = drm_metadata_set(meta, value);
+        if (err == -EINVAL) {
+            return AIMAPPER_ERROR_BAD_VALUE;
+        }
+        return err ? AIMAPPER_ERROR_NO_RESOURCES : AIMAPPER_ERROR_NONE;
+    }
+    return AIMAPPER_ERROR_UNSUPPORTED;
+}
+
+AIMapper_Error Mapper::setStandardMetadata(buffer_handle_t _Nonnull buffer,
+        int64_t standardMetadataType, const void* _Nonnull metadata, size_t metadataSize) {
+    struct drm_metadata* meta = drm_get_metadata(buffer);
+    if (!meta) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+
+    auto applier = [&]<StandardMetadataType T>(auto&& value) -> AIMapper_Error {
+        return applyMetadata<T>(meta, value);
+    };
+    return applyStandardMetadata(static_cast<StandardMetadataType>(standardMetadataType),
+            metadata, metadataSize, applier);
+}
+
+AIMapper_Error Mapper::listSupportedMetadataTypes(
+        const AIMapper_MetadataTypeDescription* _Nullable* _Nonnull outDescriptionList,
+        size_t* _Nonnull outNumberOfDescriptions) {
+#define STANDARD(type, settable) \
+        { { kStandardMetadataTypeName, static_cast<int64_t>(StandardMetadataType::type) }, \
+          nullptr, true, settable, {} }
+    static const AIMapper_MetadataTypeDescription kDescriptions[] = {
+        STANDARD(BUFFER_ID, false),
+        STANDARD(NAME, false),
+        STANDARD(WIDTH, false),
+        STANDARD(HEIGHT, false),
+        STANDARD(LAYER_COUNT, false),
+        STANDARD(PIXEL_FORMAT_REQUESTED, false),
+        STANDARD(PIXEL_FORMAT_FOURCC, false),
+        STANDARD(PIXEL_FORMAT_MODIFIER, false),
+        STANDARD(USAGE, false),
+        STANDARD(ALLOCATION_SIZE, false),
+        STANDARD(PROTECTED_CONTENT, false),
+        STANDARD(COMPRESSION, false),
+        STANDARD(INTERLACED, false),
+        STANDARD(CHROMA_SITING, false),
+        STANDARD(PLANE_LAYOUTS, false),
+        STANDARD(CROP, false),
+        STANDARD(DATASPACE, true),
+        STANDARD(BLEND_MODE, true),
+        STANDARD(SMPTE2086, true),
+        STANDARD(CTA861_3, true),
+        STANDARD(SMPTE2094_40, true),
+        STANDARD(STRIDE, false),
+    };
+#undef STANDARD
+    *outDescriptionList = kDescriptions;
+    *outNumberOfDescriptions = std::size(kDescriptions);
+    return AIMAPPER_ERROR_NONE;
+}
+
+/* the subset of standard metadata a registry snapshot can answer */
+template <StandardMetadataType T>
+static int32_t getInfoMetadata(const struct drm_buffer_info& info, auto&& provide) {
+    if constexpr (T == StandardMetadataType::BUFFER_ID) {
+        return provide(info.buffer_id);
+    }
+    if constexpr (T == StandardMetadataType::NAME) {
+        return provide(std::string(info.name));
+    }
+    if constexpr (T == StandardMetadataType::WIDTH) {
+        return provide(static_cast<uint64_t>(info.width));
+    }
+    if constexpr (T == StandardMetadataType::HEIGHT) {
+        return provide(static_cast<uint64_t>(info.height));
+    }
+    if constexpr (T == StandardMetadataType::PIXEL_FORMAT_REQUESTED) {
+        return provide(static_cast<PixelFormat>(info.format));
+    }
+    if constexpr (T == StandardMetadataType::USAGE) {
+        return provide(static_cast<BufferUsage>(info.usage));
+    }
+    if constexpr (T == StandardMetadataType::ALLOCATION_SIZE) {
+        return provide(static_cast<uint64_t>(info.size));
+    }
+    if constexpr (T == StandardMetadataType::DATASPACE) {
+        return provide(static_cast<Dataspace>(info.dataspace));
+    }
+    return -AIMAPPER_ERROR_UNSUPPORTED;
+}
+
+static void dumpBufferInfo(const struct drm_buffer_info& info,
+        AIMapper_DumpBufferCallback dumpBufferCallback, void* context) {
+    static const StandardMetadataType kTypes[] = {
+        StandardMetadataType::BUFFER_ID,
+        StandardMetadataType::NAME,
+        StandardMetadataType::WIDTH,
+        StandardMetadataType::HEIGHT,
+        StandardMetadataType::PIXEL_FORMAT_REQUESTED,
+        StandardMetadataType::USAGE,
+        StandardMetadataType::ALLOCATION_SIZE,
+        StandardMetadataType::DATASPACE,
+    };
+    auto provider = [&]<StandardMetadataType T>(auto&& provide) -> int32_t {
+        return getInfoMetadata<T>(info, provide);
+    };
+
+    std::vector<uint8_t> buffer;
+    for (StandardMetadataType type : kTypes) {
+        int32_t size = provideStandardMetadata(type, nullptr, 0, provider);
+        if (size < 0) {
+            continue;
+        }
+        buffer.resize(size);
+        provideStandardMetadata(type, buffer.data(), buffer.size(), provider);
+        dumpBufferCallback(context,
+                AIMapper_MetadataType{ kStandardMetadataTypeName, static_cast<int64_t>(type) },
+                buffer.data(), buffer.size());
+    }
+
+    const struct {
+        int64_t type;
+        int64_t value;
+    } registry[] = {
+        { DRM_REGISTRY_IMPORT_COUNT, info.import_count },
+        { DRM_REGISTRY_MAPPED, info.mapped },
+        { DRM_REGISTRY_LOCK_COUNT, info.lock_count },
+    };
+    for (const auto& entry : registry) {
+        dumpBufferCallback(context,
+                AIMapper_MetadataType{ DRM_REGISTRY_METADATA_TYPE, entry.type },
+                &entry.value, sizeof(entry.value));
+    }
+}
+
+AIMapper_Error Mapper::dumpBuffer(buffer_handle_t _Nonnull buffer,
+        AIMapper_DumpBufferCallback _Nonnull dumpBufferCallback,
+        void* _Null_unspecified context) {
+    struct drm_buffer_info info;
+    if (drm_get_buffer_info(buffer, &info) != 0) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    dumpBufferInfo(info, dumpBufferCallback, context);
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::dumpAllBuffers(
+        AIMapper_BeginDumpBufferCallback _Nonnull beginDumpBufferCallback,
+        AIMapper_DumpBufferCallback _Nonnull dumpBufferCallback,
+        void* _Null_unspecified context) {
+    std::vector<struct drm_buffer_info> infos;
+    drm_get_buffer_infos(&infos);
+    for (const auto& info : infos) {
+        beginDumpBufferCallback(context);
+        dumpBufferInfo(info, dumpBufferCallback, context);
+    }
+    return AIMAPPER_ERROR_NONE;
+}
+
+AIMapper_Error Mapper::getReservedRegion(buffer_handle_t _Nonnull buffer,
+        void* _Nullable* _Nonnull outReservedRegion, uint64_t* _Nonnull outReservedSize) {
+    if (private_handle_t::validate(buffer) < 0) {
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
+    // the allocator refuses reservedSize, so there never is one
+    *outReservedRegion = nullptr;
+    *outReservedSize = 0;
+    return AIMAPPER_ERROR_NONE;
+}
+
+} // namespace arpi::mapper
+
+extern "C" uint32_t ANDROID_HAL_MAPPER_VERSION = AIMAPPER_VERSION_5;
+
+extern "C" AIMapper_Error AIMapper_loadIMapper(AIMapper* _Nullable* _Nonnull outImplementation) {
+    static vendor::mapper::IMapperProvider<arpi::mapper::Mapper> provider;
+    return provider.load(outImplementation);
+}